@@ -0,0 +1,491 @@
+#include <chrono>
+#include <random>
+#include <thread>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <numeric>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "pokerlib.hpp"
+
+using namespace std;
+using namespace pokerlib;
+
+// Benchmark scenarios of the lookups, results as JSON or CSV.
+//   bench [--format json|csv] [--out file] [--filter substring] [--hands N] [--seed N] [--threads N] [--counters] [--generate]
+
+// Hardware and software counters of a scenario, -1 where not available.
+enum Counter { CYCLES, LLC_MISSES, DTLB_MISSES, PAGE_FAULTS, COUNTERS };
+
+static const char* const counter_names[COUNTERS] = {"cycles", "llc_misses", "dtlb_misses", "page_faults"};
+
+struct Result {
+    string  scenario;
+    string  table;
+    int     cards;
+    int     threads;
+    size_t  hands;
+    double  seconds;
+    int64_t counters[COUNTERS];
+};
+
+struct Options {
+    string   format  = "json";
+    string   out;
+    string   filter;
+    size_t   hands   = 10000000;
+    uint64_t seed    = 42;
+    int      threads = 0;
+    bool     counters = false;
+    bool     generate = false;
+};
+
+// perf_event_open counters of this process and the threads it starts. A counter
+// the kernel refuses (no PMU in a VM, perf_event_paranoid, seccomp) stays closed
+// and reads as -1.
+class Counters {
+public:
+    explicit Counters(bool enabled) {
+        for (int i = 0; i < COUNTERS; i++) {
+            fds_[i] = -1;
+        }
+        if (!enabled) {
+            return;
+        }
+
+        open(CYCLES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        open(LLC_MISSES, PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        open(DTLB_MISSES, PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        open(PAGE_FAULTS, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+    }
+
+    ~Counters() {
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    Counters(const Counters&)            = delete;
+    Counters& operator=(const Counters&) = delete;
+
+    void start() {
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    void stop(int64_t* values) {
+        for (int i = 0; i < COUNTERS; i++) {
+            values[i] = -1;
+            if (fds_[i] >= 0) {
+                ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+                uint64_t value;
+                if (read(fds_[i], &value, sizeof(value)) == sizeof(value)) {
+                    values[i] = (int64_t)value;
+                }
+            }
+        }
+    }
+
+private:
+    void open(Counter counter, uint32_t type, uint64_t config) {
+        perf_event_attr attr{};
+        attr.size           = sizeof(attr);
+        attr.type           = type;
+        attr.config         = config;
+        attr.disabled       = 1;
+        attr.inherit        = 1; // worker threads of the scaling scenario
+        attr.exclude_kernel = 1; // all perf_event_paranoid 2 allows
+        attr.exclude_hv     = 1;
+
+        fds_[counter] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fds_[counter] < 0) {
+            _PDEBUG("Counter %s is not available: %s", counter_names[counter], strerror(errno));
+        }
+    }
+
+    int fds_[COUNTERS];
+};
+
+// Random hands of distinct cards 1..deck_size, size cards each.
+static vector<int> random_hands(int deck_size, int size, size_t count, uint64_t seed) {
+    mt19937_64 rng(seed);
+    vector<int> deck(deck_size);
+    for (int i = 0; i < deck_size; i++) {
+        deck[i] = i + 1;
+    }
+
+    vector<int> hands(count * size);
+    for (size_t h = 0; h < count; h++) {
+        for (int i = 0; i < size; i++) {
+            swap(deck[i], deck[i + rng() % (deck_size - i)]);
+            hands[h * size + i] = deck[i];
+        }
+    }
+    return hands;
+}
+
+static double seconds_since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+class Bench {
+public:
+    explicit Bench(const Options& options) : options_(options), counters_(options.counters) {}
+
+    // Runs body(), which handles hands hands, if the scenario passes the filter.
+    void run(const string& scenario, const string& table, int cards, int threads, size_t hands, const function<long()>& body) {
+        string name = scenario + "/" + table + "/" + to_string(cards) + "/" + to_string(threads);
+        if (!options_.filter.empty() && name.find(options_.filter) == string::npos) {
+            return;
+        }
+
+        Result result{scenario, table, cards, threads, hands, 0, {}};
+        counters_.start();
+        auto start = chrono::steady_clock::now();
+        checksum_ += body();
+        result.seconds = seconds_since(start);
+        counters_.stop(result.counters);
+
+        string counters;
+        for (int i = 0; i < COUNTERS; i++) {
+            if (result.counters[i] >= 0) {
+                counters += " " + string(counter_names[i]) + " " + format_per_hand(result.counters[i], hands);
+            }
+        }
+        _PDEBUG("%-40s %8.2f ns/hand %10.2fM hands/s%s", name.c_str(), result.seconds * 1e9 / hands, hands / result.seconds / 1e6, counters.c_str());
+        results_.push_back(result);
+    }
+
+    void write(ostream& out) const {
+        if (options_.format == "csv") {
+            out << "scenario,table,cards,threads,hands,seconds,ns_per_hand,hands_per_sec";
+            for (const char* name : counter_names) {
+                out << "," << name << "_per_hand";
+            }
+            out << "\n";
+            for (const Result& r : results_) {
+                out << r.scenario << "," << r.table << "," << r.cards << "," << r.threads << "," << r.hands << ","
+                    << r.seconds << "," << r.seconds * 1e9 / r.hands << "," << r.hands / r.seconds;
+                for (int64_t value : r.counters) {
+                    out << "," << (value >= 0 ? format_per_hand(value, r.hands) : "");
+                }
+                out << "\n";
+            }
+            return;
+        }
+
+        out << "{\n  \"kernel\": \"" << lookup_batch_kernel() << "\",\n  \"seed\": " << options_.seed << ",\n  \"results\": [\n";
+        for (size_t i = 0; i < results_.size(); i++) {
+            const Result& r = results_[i];
+            out << "    {\"scenario\": \"" << r.scenario << "\", \"table\": \"" << r.table << "\", \"cards\": " << r.cards
+                << ", \"threads\": " << r.threads << ", \"hands\": " << r.hands << ", \"seconds\": " << r.seconds
+                << ", \"ns_per_hand\": " << r.seconds * 1e9 / r.hands << ", \"hands_per_sec\": " << r.hands / r.seconds;
+            for (int c = 0; c < COUNTERS; c++) {
+                out << ", \"" << counter_names[c] << "_per_hand\": " << (r.counters[c] >= 0 ? format_per_hand(r.counters[c], r.hands) : "null");
+            }
+            out << "}" << (i + 1 < results_.size() ? ",\n" : "\n");
+        }
+        out << "  ]\n}\n";
+    }
+
+    const Options& options() const { return options_; }
+
+private:
+    static string format_per_hand(int64_t value, size_t hands) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.4g", (double)value / hands);
+        return buffer;
+    }
+
+    Options        options_;
+    Counters       counters_;
+    vector<Result> results_;
+    long           checksum_ = 0; // keeps the lookups from being optimized out
+};
+
+// Every combination of size cards out of deck_size, in order.
+static void enumerate(Bench& bench, Evaluator& evaluator, const string& table, int deck_size, int size) {
+    size_t hands = 1;
+    for (int i = 0; i < size; i++) {
+        hands = hands * (deck_size - i) / (i + 1);
+    }
+
+    bench.run("enumerate", table, size, 1, hands, [&] {
+        const int* ranks = deck_size == JOKER_DECK_SIZE ? evaluator.table() : evaluator.standard_table();
+        int c[7];
+        long sum = 0;
+        for (c[0] = 1; c[0] <= deck_size; c[0]++)
+        for (c[1] = c[0] + 1; c[1] <= deck_size; c[1]++)
+        for (c[2] = c[1] + 1; c[2] <= deck_size; c[2]++)
+        for (c[3] = c[2] + 1; c[3] <= deck_size; c[3]++)
+        for (c[4] = c[3] + 1; c[4] <= deck_size; c[4]++) {
+            if (size == 5) {
+                sum += table_lookup(ranks, deck_size, c, 5);
+                continue;
+            }
+            for (c[5] = c[4] + 1; c[5] <= deck_size; c[5]++) {
+                if (size == 6) {
+                    sum += table_lookup(ranks, deck_size, c, 6);
+                    continue;
+                }
+                for (c[6] = c[5] + 1; c[6] <= deck_size; c[6]++) {
+                    sum += table_lookup(ranks, deck_size, c, 7);
+                }
+            }
+        }
+        return sum;
+    });
+}
+
+// Lookups of pregenerated random hands, one call per hand.
+static void random_lookup(Bench& bench, Evaluator& evaluator, const string& table, int deck_size, int size) {
+    size_t      count = bench.options().hands;
+    vector<int> hands = random_hands(deck_size, size, count, bench.options().seed);
+
+    bench.run("random", table, size, 1, count, [&] {
+        long sum = 0;
+        for (size_t i = 0; i < count; i++) {
+            sum += deck_size == JOKER_DECK_SIZE ? evaluator.lookup(&hands[i * size], size) : evaluator.standard_lookup(&hands[i * size], size);
+        }
+        return sum;
+    });
+
+    vector<int> out(count);
+    bench.run("batch", table, size, 1, count, [&] {
+        if (deck_size == JOKER_DECK_SIZE)
+            evaluator.lookup_batch(&hands[0], size, size, &out[0], count);
+        else
+            evaluator.standard_lookup_batch(&hands[0], size, size, &out[0], count);
+        return (long)out[count / 2];
+    });
+}
+
+// 5 card lookups in the flat tables, the same hands as random_lookup().
+static void flat5(Bench& bench, Evaluator& evaluator, const string& table, int deck_size) {
+    size_t          count = bench.options().hands;
+    vector<int>     hands = random_hands(deck_size, 5, count, bench.options().seed);
+    const uint16_t* flat  = deck_size == JOKER_DECK_SIZE ? evaluator.flat5_table() : evaluator.flat5_standard_table();
+
+    bench.run("flat5", table, 5, 1, count, [&] {
+        long sum = 0;
+        for (size_t i = 0; i < count; i++) {
+            sum += flat5_lookup(flat, &hands[i * 5]);
+        }
+        return sum;
+    });
+
+    vector<int> out(count);
+    bench.run("flat5_batch", table, 5, 1, count, [&] {
+        flat5_lookup_batch(flat, &hands[0], 5, &out[0], count);
+        return (long)out[count / 2];
+    });
+}
+
+// 5 to 7 card lookups in the rank hash table, the same hands as random_lookup().
+static void rank_hash(Bench& bench, Evaluator& evaluator, const string& table, int deck_size, int size) {
+    size_t               count = bench.options().hands;
+    vector<int>          hands = random_hands(deck_size, size, count, bench.options().seed);
+    const RankHashTable* hash  = evaluator.rank_hash_table();
+
+    bench.run("rank_hash", table, size, 1, count, [&] {
+        long sum = 0;
+        for (size_t i = 0; i < count; i++) {
+            sum += rank_hash_lookup(hash, &hands[i * size], size);
+        }
+        return sum;
+    });
+
+    vector<int> out(count);
+    bench.run("rank_hash_batch", table, size, 1, count, [&] {
+        rank_hash_lookup_batch(hash, &hands[0], size, size, &out[0], count);
+        return (long)out[count / 2];
+    });
+}
+
+// Cactus Kev evaluation without tables, 5 cards and the best of 21 for 7 cards.
+static void kev(Bench& bench) {
+    size_t      count = bench.options().hands / 10;
+    vector<int> hands = random_hands(STANDARD_DECK_SIZE, 7, count, bench.options().seed);
+    for (int& card : hands) {
+        card = to_kev(card - 1);
+    }
+
+    bench.run("eval_5hand", "kev", 5, 1, count, [&] {
+        long sum = 0;
+        for (size_t i = 0; i < count; i++) {
+            sum += eval_5hand(&hands[i * 7]);
+        }
+        return sum;
+    });
+    bench.run("eval_7hand", "kev", 7, 1, count, [&] {
+        long sum = 0;
+        for (size_t i = 0; i < count; i++) {
+            sum += eval_7hand(&hands[i * 7]);
+        }
+        return sum;
+    });
+}
+
+// First lookups on a table whose pages were dropped from the page cache, then
+// the same after a warm-up. Runs before anything maps the table: the page cache
+// keeps the pages mapped by this or any other process.
+static void cold_and_warm(Bench& bench, const string& file_name) {
+    int fd = open(file_name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return; // embedded tables
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+
+    size_t      count = bench.options().hands / 10;
+    vector<int> hands = random_hands(JOKER_DECK_SIZE, 7, count, bench.options().seed + 1);
+
+    EvaluatorOptions options;
+    options.ranks_file = file_name;
+    options.generate   = false;
+
+    Evaluator cold(options);
+    bench.run("cold", "joker", 7, 1, count, [&] {
+        long sum = 0;
+        for (size_t i = 0; i < count; i++) {
+            sum += cold.lookup(&hands[i * 7], 7);
+        }
+        return sum;
+    });
+
+    cold.unload();
+
+    Evaluator warm(options);
+    warm.warm_up(WarmUp::TOUCH);
+    bench.run("warm", "joker", 7, 1, count, [&] {
+        long sum = 0;
+        for (size_t i = 0; i < count; i++) {
+            sum += warm.lookup(&hands[i * 7], 7);
+        }
+        return sum;
+    });
+}
+
+// Generation of the standard table into a scratch file, hands counts the 7 card hands it covers.
+static void generation(Bench& bench) {
+    string file_name = "bench_" + to_string(getpid()) + "_" + STANDARD_RANKS_FILE_NAME;
+    bench.run("generate", "standard", 7, 1, 133784560, [&] {
+        generate_standard(file_name, bench.options().threads);
+        return 0L;
+    });
+    unlink(file_name.c_str());
+}
+
+// Random 7 card lookups split between 1, 2, 4... threads.
+static void scaling(Bench& bench, Evaluator& evaluator) {
+    size_t      count = bench.options().hands;
+    vector<int> hands = random_hands(JOKER_DECK_SIZE, 7, count, bench.options().seed + 2);
+
+    int max_threads = bench.options().threads > 0 ? bench.options().threads : (int)std::max(1u, thread::hardware_concurrency());
+    vector<int> counts;
+    for (int threads = 1; threads < max_threads; threads *= 2) {
+        counts.push_back(threads);
+    }
+    counts.push_back(max_threads);
+
+    for (int threads : counts) {
+        bench.run("threads", "joker", 7, threads, count, [&] {
+            vector<long>   sums(threads);
+            vector<thread> workers;
+            for (int t = 0; t < threads; t++) {
+                workers.emplace_back([&, t] {
+                    long sum = 0;
+                    for (size_t i = count * t / threads; i < count * (t + 1) / threads; i++) {
+                        sum += evaluator.lookup(&hands[i * 7], 7);
+                    }
+                    sums[t] = sum;
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+            return accumulate(sums.begin(), sums.end(), 0L);
+        });
+    }
+}
+
+int main(int argc, char** argv) try {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--format" && i + 1 < argc)
+            options.format = argv[++i];
+        else if (arg == "--out" && i + 1 < argc)
+            options.out = argv[++i];
+        else if (arg == "--filter" && i + 1 < argc)
+            options.filter = argv[++i];
+        else if (arg == "--hands" && i + 1 < argc)
+            options.hands = stoull(argv[++i]);
+        else if (arg == "--seed" && i + 1 < argc)
+            options.seed = stoull(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            options.threads = atoi(argv[++i]);
+        else if (arg == "--counters")
+            options.counters = true;
+        else if (arg == "--generate")
+            options.generate = true;
+        else {
+            fprintf(stderr, "Usage: %s [--format json|csv] [--out file] [--filter substring] [--hands N] [--seed N] [--threads N] [--counters] [--generate]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    Bench      bench(options);
+    Evaluator& evaluator = default_evaluator();
+    cold_and_warm(bench, evaluator.options().ranks_file);
+    evaluator.load();
+    evaluator.load_standard();
+
+    for (int size = 5; size < 8; size++) {
+        enumerate(bench, evaluator, "standard", STANDARD_DECK_SIZE, size);
+        enumerate(bench, evaluator, "joker", JOKER_DECK_SIZE, size);
+    }
+    for (int size = 5; size < 8; size++) {
+        random_lookup(bench, evaluator, "standard", STANDARD_DECK_SIZE, size);
+        random_lookup(bench, evaluator, "joker", JOKER_DECK_SIZE, size);
+    }
+    flat5(bench, evaluator, "standard", STANDARD_DECK_SIZE);
+    flat5(bench, evaluator, "joker", JOKER_DECK_SIZE);
+    for (int size = 5; size < 8; size++) {
+        rank_hash(bench, evaluator, "standard", STANDARD_DECK_SIZE, size);
+        rank_hash(bench, evaluator, "joker", JOKER_DECK_SIZE, size);
+    }
+    kev(bench);
+    scaling(bench, evaluator);
+    if (options.generate) {
+        generation(bench);
+    }
+
+    if (options.out.empty()) {
+        bench.write(cout);
+    }
+    else {
+        ofstream out(options.out);
+        bench.write(out);
+    }
+    return 0;
+}
+catch (Error& e) {
+    fprintf(stderr, "Bench failed: %s\n", e.what());
+    return 1;
+}
@@ -0,0 +1,76 @@
+#include <string>
+#include <cstdlib>
+
+#include "pokerlib.hpp"
+
+using namespace std;
+using namespace pokerlib;
+
+// Builds the rank tables into a directory, used by the pokerlib_tables target.
+//   build_tables <dir> [--threads N] [--compact] [--relayout] [--truncated] [--flat5] [--rank-hash]
+int main(int argc, char** argv) try {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <dir> [--threads N] [--compact] [--relayout] [--truncated] [--flat5] [--rank-hash]\n", argv[0]);
+        return 1;
+    }
+
+    string dir       = argv[1];
+    int    threads   = 0;
+    bool   compact   = false;
+    bool   relayout  = false;
+    bool   truncated = false;
+    bool   flat5     = false;
+    bool   rank_hash = false;
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (arg == "--compact")
+            compact = true;
+        else if (arg == "--relayout")
+            relayout = true;
+        else if (arg == "--truncated")
+            truncated = true;
+        else if (arg == "--flat5")
+            flat5 = true;
+        else if (arg == "--rank-hash")
+            rank_hash = true;
+    }
+
+    EvaluatorOptions options;
+    options.ranks_file          = dir + "/" + RANKS_FILE_NAME;
+    options.standard_ranks_file = dir + "/" + STANDARD_RANKS_FILE_NAME;
+    options.compact_ranks_file  = dir + "/" + COMPACT_RANKS_FILE_NAME;
+    options.compact             = compact;
+    options.threads             = threads;
+    options.relayout            = relayout;
+
+    Evaluator evaluator(options);
+    evaluator.load();
+    evaluator.load_standard();
+
+    // tables cut after 5 and 6 cards, the flat and the rank hash ones, made from the ones above
+    for (int max_cards = 5; truncated && max_cards < 7; max_cards++) {
+        options.max_cards = max_cards;
+        Evaluator truncated_evaluator(options);
+        truncated_evaluator.load();
+        truncated_evaluator.load_standard();
+    }
+    if (flat5) {
+        options.max_cards = 5;
+        options.flat5     = true;
+        Evaluator flat_evaluator(options);
+        flat_evaluator.flat5_table();
+        flat_evaluator.flat5_standard_table();
+    }
+    if (rank_hash) {
+        options.rank_hash = true;
+        Evaluator hash_evaluator(options);
+        hash_evaluator.rank_hash_table();
+    }
+    return 0;
+}
+catch (Error& e) {
+    fprintf(stderr, "Tables failed: %s\n", e.what());
+    return 1;
+}
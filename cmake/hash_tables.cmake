@@ -0,0 +1,9 @@
+# Records SHA-256 of the generated tables in sha256sum format.
+#   cmake -DTABLES="a;b" -DOUTPUT=file -P hash_tables.cmake
+set(content "")
+foreach(table ${TABLES})
+    file(SHA256 ${table} hash)
+    get_filename_component(name ${table} NAME)
+    string(APPEND content "${hash}  ${name}\n")
+endforeach()
+file(WRITE ${OUTPUT} "${content}")
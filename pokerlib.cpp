@@ -16,18 +16,31 @@
 
 
 #include <set>
+#include <unordered_map>
 #include <vector>
 #include <ctime>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cerrno>
 #include <iterator>
 #include <algorithm>
 #include <type_traits>
 #include <atomic>
+#include <chrono>
+#include <random>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/magic.h>
 
 #include "lookup_tables.hpp"
 #include "pokerlib.hpp"
@@ -41,10 +54,6 @@ namespace pokerlib {
 extern unsigned short hash_adjust[];
 extern unsigned short hash_values[];
 
-const int* get_table() {
-    return reinterpret_cast<const int*>(ranks_map.data());
-}
-
 // returns a 64-bit hand ID, for up to 8 cards, stored 1 per byte.
 int64_t make_id(int64_t IDin, int newcard, int &numcards, bool with_joker, const Debug& debug) {
     int suitcount[SUITS_COUNT + 1] = {};
@@ -305,11 +314,94 @@ int do_eval(int64_t IDin, int numcards, const Debug& debug) {
     return convert_kev_rank(result);
 }
 
+// IDs are sorted by the number of cards, finds where every level of a table starts.
+// level_start[7] is the number of IDs, the table may have unused rows after them.
+// The children of the leaf level nodes are hand ranks, levels after it are empty.
+static std::vector<int> table_levels(const int* ranks, int deck_size, int rows, int leaf = 6) {
+    const int row = deck_size + 1;
+
+    std::vector<int> depth(rows, -1);
+    std::vector<int> level_start(8, -1);
+    depth[0] = 0;
+    int numIDs = 0;
+    for (int IDnum = 0; IDnum < rows && depth[IDnum] >= 0; IDnum++, numIDs++) {
+        if (level_start[depth[IDnum]] < 0) {
+            level_start[depth[IDnum]] = IDnum;
+        }
+        if (depth[IDnum] == leaf) {
+            continue; // children are hand ranks
+        }
+        for (int card = 1; card < deck_size + 1; card++) {
+            int p = ranks[(IDnum + 1) * row + card];
+            if (p) {
+                depth[p / row - 1] = depth[IDnum] + 1;
+            }
+        }
+    }
+
+    level_start[7] = numIDs;
+    for (int level = 6; level >= 0; level--) {
+        if (level_start[level] < 0) {
+            level_start[level] = level_start[level + 1];
+        }
+    }
+    return level_start;
+}
+
+// A node's value is the max over its children, so for a hand with jokers the best
+// substitution is found by walking the real cards and reading the value of that node,
+// no matter how many cards are still wild. Adding a card which is already in the hand
+// leads to the 0 entry and never wins.
+JokerEvalTable::JokerEvalTable(const int* ranks, size_t size) : ranks(ranks) {
+    const int row = STANDARD_DECK_SIZE + 1;
+    std::vector<int> level_start = table_levels(ranks, STANDARD_DECK_SIZE, (int)(size / sizeof(int) / row) - 1);
+    int numIDs = level_start[7];
+
+    for (int n = 5; n < 8; n++) {
+        std::vector<int>& values = best[n - 5];
+        values.assign(numIDs, 0);
+
+        // children always have more cards, so go from the last level to the first one
+        for (int level = n == 7 ? 6 : n; level >= 0; level--) {
+            tbb::parallel_for(tbb::blocked_range<int>(level_start[level], level_start[level + 1]), [&](const tbb::blocked_range<int>& range) {
+                for (int IDnum = range.begin(); IDnum != range.end(); IDnum++) {
+                    const int* children = &ranks[(IDnum + 1) * row];
+                    if (level == n) {
+                        values[IDnum] = children[0]; // 5 or 6 card hand rank
+                        continue;
+                    }
+
+                    int value = 0;
+                    for (int card = 1; card < STANDARD_DECK_SIZE + 1; card++) {
+                        int p = children[card];
+                        if (level == 6)
+                            value = std::max(value, p);
+                        else if (p)
+                            value = std::max(value, values[p / row - 1]);
+                    }
+                    values[IDnum] = value;
+                }
+            });
+        }
+    }
+}
+
+static int joker_eval(int64_t IDin, int numcards, const JokerEvalTable* table, const Debug& debug);
+
+int do_joker_eval(int64_t IDin, int numcards, const Debug& debug) {
+    return joker_eval(IDin, numcards, nullptr, debug);
+}
+
+int do_joker_eval(int64_t IDin, int numcards, const JokerEvalTable& table, const Debug& debug) {
+    return joker_eval(IDin, numcards, &table, debug);
+}
+
 // Converts a 64bit handID to an absolute ranking.
 // I guess I have some explaining to do here...
 // I used the Cactus Kevs Eval http://suffe.cool/poker/evaluator.html
 // I Love the pokersource for speed, but I needed to do some tweaking to get it my way and Cactus Kevs stuff was easy to tweak ;-)
-int do_joker_eval(int64_t IDin, int numcards, const Debug& debug) {
+// Without a table every substitution of the jokers is evaluated.
+static int joker_eval(int64_t IDin, int numcards, const JokerEvalTable* table, const Debug& debug) {
     if (IDin == 0) {
         return 0;
     }
@@ -331,7 +423,7 @@ int do_joker_eval(int64_t IDin, int numcards, const Debug& debug) {
     int jokercount = 0;
     int wk[8] = {}; // "work" intentially keeping one as a 0 end
     int holdcards[8] = {};
-    int jokers[5] = {};
+    int jokers[8] = {}; // 0 after the last joker, sized so the inlined mutate5..7 stay in bounds
     int rankcount[JOKER_RANKS_COUNT + 1] = {};
 
     // convert all 7 cards (0s are ok)
@@ -420,7 +512,8 @@ int do_joker_eval(int64_t IDin, int numcards, const Debug& debug) {
         verbose = true;
     }
 
-    if (jokercount) {
+    if (jokercount && (verbose || !table)) {
+        // brute force every substitution, to print them or without a table
         switch (numevalcards) {
             case 5:
                 result = mutate5(wk, jokers, 0, verbose);
@@ -434,8 +527,26 @@ int do_joker_eval(int64_t IDin, int numcards, const Debug& debug) {
             default:
                 throw Error("Problem with numcards = " + std::to_string(numcards));
         }
-    } else {
+    } else if (!table) {
         result = standard_lookup(wk, numevalcards);
+    } else {
+        if (numevalcards < 5 || numevalcards > 7) {
+            throw Error("Problem with numcards = " + std::to_string(numcards));
+        }
+
+        // walk the standard table with the real cards only, jokers are the cards left to add
+        const int* ranks = table->ranks;
+        int p = STANDARD_DECK_SIZE + 1;
+        for (cardnum = 0; cardnum < numevalcards; cardnum++) {
+            if ((holdcards[cardnum] >> 4) - 1 != RANKS_COUNT) { // not a joker
+                p = ranks[p + wk[cardnum]];
+            }
+        }
+
+        if (jokercount)
+            result = p ? table->best[numevalcards - 5][p / (STANDARD_DECK_SIZE + 1) - 1] : 0;
+        else
+            result = numevalcards == 7 ? p : ranks[p];
     }
 
     if(debug.on && IDin == debug.id) {
@@ -447,409 +558,2347 @@ int do_joker_eval(int64_t IDin, int numcards, const Debug& debug) {
     return result;
 }
 
-void generate_standard(const std::string& file_name) {
-    int     IDslot, card = 0;
-    int64_t ID;
-
-    clock_t timer = clock(); // remember when I started
+// Finds the slot of an ID which is already in the IDs array, this is the
+// read-only part of save_id, so it is safe to call from many threads once
+// the IDs array is stable.
+static int find_slot(int64_t ID, const std::vector<int64_t>& IDs, int numIDs) {
+    if (ID == 0) {
+        return 0;
+    }
+    return (int)(std::lower_bound(IDs.begin(), IDs.begin() + numIDs, ID) - IDs.begin());
+}
 
-    std::vector<int> HR(STANDARD_HAND_RANKS_COUNT);
-    std::vector<int64_t> IDs(STANDARD_IDS_COUNT);
+// Sorts IDs of numcards cards with a LSD radix sort, one pass per card byte.
+static void radix_sort_ids(std::vector<int64_t>& IDs, int numcards) {
+    std::vector<int64_t> sorted(IDs.size());
+    for (int cardnum = 0; cardnum < numcards; cardnum++) {
+        size_t offsets[256 + 1] = {};
+        for (int64_t ID : IDs) {
+            offsets[((ID >> (8 * cardnum)) & 0xFF) + 1]++;
+        }
+        for (int i = 0; i < 256; i++) {
+            offsets[i + 1] += offsets[i];
+        }
+        for (int64_t ID : IDs) {
+            sorted[offsets[(ID >> (8 * cardnum)) & 0xFF]++] = ID;
+        }
+        IDs.swap(sorted);
+    }
+}
 
-    int     numIDs   = 1;
-    int     numcards = 0;
-    int     maxHR    = 0;
-    int64_t maxID    = 0;
+// Fills the IDs array with every hand ID of up to 6 cards, returns the number of IDs.
+// IDs are discovered one card count at a time: all successors of the previous level
+// are made in parallel, then sorted and deduplicated. An ID with more cards always
+// has a greater value (cards are stored 1 per byte), so appending the levels gives
+// exactly the sorted array save_id used to build by insertion.
+static int discover_ids(std::vector<int64_t>& IDs, int deck_size, bool with_joker) {
+    int numIDs = 1; // IDs[0] is the empty hand
+    int first  = 0; // the first ID of the previous level
+
+    for (int level = 1; level < 7; level++) {
+        int                  count = numIDs - first;
+        std::vector<int64_t> next((size_t)count * deck_size);
+
+        tbb::parallel_for(tbb::blocked_range<int>(0, count), [&](const tbb::blocked_range<int>& range) {
+            int numcards = 0;
+            for (int i = range.begin(); i != range.end(); i++) {
+                // start at 1 so I have a zero catching entry (just in case)
+                for (int card = 1; card < deck_size + 1; card++) {
+                    // the ids above contain cards upto the current card.  Now add a new card
+                    next[(size_t)i * deck_size + card - 1] = make_id(IDs[first + i], card, numcards, with_joker);
+                }
+            }
+        });
 
-    // step through the ID array - always shifting the current ID and
-    // adding 52 cards to the end of the array.
-    // when I am at 7 cards put the Hand Rank in!!
-    // stepping through the ID array is perfect!!
-    // SA: indeed
+        // don't use up a record for a 0!
+        next.erase(std::remove(next.begin(), next.end(), 0), next.end());
+        radix_sort_ids(next, level);
+        next.erase(std::unique(next.begin(), next.end()), next.end());
 
-    int IDnum;
+        if (numIDs + next.size() > IDs.size()) {
+            throw Error("Too many IDs: " + std::to_string(numIDs + next.size()));
+        }
 
-    _PDEBUG("Getting Card IDs!");
+        std::copy(next.begin(), next.end(), IDs.begin() + numIDs);
+        first = numIDs;
+        numIDs += (int)next.size();
 
-    // Jmd: Okay, this loop is going to fill up the IDs[] array which has
-    // 612,967 slots. as this loops through and find new combinations it
-    // adds them to the end. I need this list to be stable when I set the
-    // handranks (next set)  (I do the insertion sort on new IDs these)
-    // so I had to get the IDs first and then set the handranks
-    // SA: will stop if there are no combinations left
-    for (IDnum = 0; IDs[IDnum] || IDnum == 0; IDnum++) {
-        // start at 1 so I have a zero catching entry (just in case)
-        for (card = 1; card < STANDARD_DECK_SIZE + 1; card++) {
-            // the ids above contain cards upto the current card.  Now add a new card
-            ID = make_id(IDs[IDnum], card, numcards); // get the new ID for it
-            //count_jokercombs(ID, jokercombs);
-            // and save it in the list if I am not on the 7th card
-            if (numcards < 7)
-                save_id(ID, IDs, maxID, numIDs);
-        }
         // show progress -- this counts up to 612976
         // SA: if there are jokers, counts up to ~1M
-        _PPRINT("\rID - %d %llX %llX", IDnum, ID, IDs[IDnum+1]);
+        _PDEBUG("ID - %d cards %d", level, numIDs);
     }
 
-    _PDEBUG("\nSetting HandRanks! %d", IDnum);
-
-    // this is as above, but will not add anything to the ID list, so it is stable
-    for (IDnum = 0; IDs[IDnum] || IDnum == 0; IDnum++) {
-        // start at 1 so I have a zero catching entry (just in case)
-        for (card = 1; card < STANDARD_DECK_SIZE + 1; card++) {
-            ID = make_id(IDs[IDnum], card, numcards);
+    return numIDs;
+}
 
-            if (numcards < 7) {
-                // when in the index mode (< 7 cards) get the id to save
-                IDslot = save_id(ID, IDs, maxID, numIDs) * (STANDARD_DECK_SIZE + 1) + STANDARD_DECK_SIZE + 1;
-            }
-            else {
-                // if I am at the 7th card, get the equivalence class ("hand rank") to save
-                IDslot = do_eval(ID, numcards);
+// Sets pointers to the next card and hand ranks for every discovered ID.
+// Every ID owns its own row of the HR array, so IDs are split between threads
+// and the result is the same as if they were processed one by one.
+template <typename Eval>
+static void set_hand_ranks(int* HR, const std::vector<int64_t>& IDs, int numIDs, int deck_size, bool with_joker, Eval eval) {
+    std::atomic<int> done{0};
+
+    tbb::parallel_for(tbb::blocked_range<int>(0, numIDs), [&](const tbb::blocked_range<int>& range) {
+        for (int IDnum = range.begin(); IDnum != range.end(); IDnum++) {
+            int numcards = 0;
+
+            // start at 1 so I have a zero catching entry (just in case)
+            for (int card = 1; card < deck_size + 1; card++) {
+                int64_t ID = make_id(IDs[IDnum], card, numcards, with_joker);
+                int     IDslot;
+
+                if (numcards < 7) {
+                    // when in the index mode (< 7 cards) get the id to save
+                    IDslot = find_slot(ID, IDs, numIDs) * (deck_size + 1) + deck_size + 1;
+                }
+                else {
+                    // if I am at the 7th card, get the equivalence class ("hand rank") to save
+                    IDslot = eval(ID, numcards);
+                }
+
+                // and save the pointer to the next card or the handrank
+                HR[IDnum * (deck_size + 1) + card + deck_size + 1] = IDslot;
             }
 
-            // find where to put it
-            maxHR     = IDnum * (STANDARD_DECK_SIZE + 1) + card + STANDARD_DECK_SIZE + 1;
-            // and save the pointer to the next card or the handrank
-            HR[maxHR] = IDslot;
-            //_PDEBUG("ID0 - %d %d", IDnum, maxHR); // show the progress -- counts to 612976 again
+            if (numcards == 6 || numcards == 7) {
+                // an extra, If you want to know what the handrank when there is 5 or 6 cards
+                // you can just do HR[u3] or HR[u4] from below code for Handrank of the 5 or
+                // 6 card hand
+                // this puts the above handrank into the array
+                HR[IDnum * (deck_size + 1) + deck_size + 1] = eval(IDs[IDnum], numcards);
+            }
         }
 
-        if (numcards == 6 || numcards == 7) {
-            // an extra, If you want to know what the handrank when there is 5 or 6 cards
-            // you can just do HR[u3] or HR[u4] from below code for Handrank of the 5 or
-            // 6 card hand
-            // this puts the above handrank into the array
-            HR[IDnum * (STANDARD_DECK_SIZE + 1) + STANDARD_DECK_SIZE + 1] = do_eval(IDs[IDnum], numcards);
-            //_PDEBUG("ID6 - %d %d", IDnum, IDnum * (DECK_SIZE + 1) + DECK_SIZE + 1); // show the progress -- counts to 612976 again
-        }
+        _PPRINT("\rID - %d", done += (int)range.size()); // show the progress -- counts to numIDs again
+    });
+}
 
-        _PPRINT("\rID - %d", IDnum); // show the progress -- counts to 612976 again
+const size_t TABLE_PAGE_SIZE = 4096;
+
+// FNV-1a over 64 bit words of the table; with stride > 1 only the first page of every stride pages.
+static uint64_t table_checksum(const uint8_t* data, size_t size, size_t stride) {
+    uint64_t hash  = 0xcbf29ce484222325;
+    size_t   chunk = stride > 1 ? TABLE_PAGE_SIZE : size;
+    for (size_t offset = 0; offset < size; offset += chunk * stride) {
+        size_t end = std::min(size, offset + chunk);
+        size_t i   = offset;
+        for (; i + sizeof(uint64_t) <= end; i += sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, data + i, sizeof(word));
+            hash = (hash ^ word) * 0x100000001b3;
+        }
+        for (; i < end; i++) {
+            hash = (hash ^ data[i]) * 0x100000001b3;
+        }
     }
+    return hash;
+}
 
+// Fills the header in front of a generated table of size bytes.
+static void write_table_header(uint8_t* file, TableFormat format, int deck_size, size_t size, const std::vector<int>& levels) {
+    TableHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic            = TABLE_MAGIC;
+    header.version          = TABLE_VERSION;
+    header.format           = (uint32_t)format;
+    header.deck_size        = deck_size;
+    header.size             = size;
+    header.checksum         = table_checksum(file + sizeof(header), size, 1);
+    header.sampled_checksum = table_checksum(file + sizeof(header), size, TABLE_SAMPLE_STRIDE);
+    std::copy(levels.begin(), levels.end(), header.levels);
+    memcpy(file, &header, sizeof(header));
+}
 
-    _PDEBUG("\nNumber IDs = %d\nmaxHR = %d", numIDs, maxHR); // for warm fuzzys
-
-    timer = clock() - timer; // end the timer
+// Checks the header of a mapped table file in O(header), returns what's wrong or an empty string.
+static std::string check_table_header(const char* data, size_t size, TableFormat format, int deck_size) {
+    if (size < sizeof(TableHeader)) {
+        return "no header";
+    }
 
-    _PDEBUG("Training seconds = %.2f", (float)timer / CLOCKS_PER_SEC);
+    const TableHeader* header = reinterpret_cast<const TableHeader*>(data);
+    if (header->magic != TABLE_MAGIC) {
+        return "no header";
+    }
+    if (header->version != TABLE_VERSION) {
+        return "version " + std::to_string(header->version) + " instead of " + std::to_string(TABLE_VERSION);
+    }
+    if (header->format != (uint32_t)format || header->deck_size != (uint32_t)deck_size) {
+        return "wrong table format or deck";
+    }
+    if (header->size != size - sizeof(TableHeader)) {
+        return "truncated, " + std::to_string(size - sizeof(TableHeader)) + " of " + std::to_string(header->size) + " bytes";
+    }
+    for (int level = 0; level < 7; level++) {
+        if (header->levels[level] < 0 || header->levels[level] > header->levels[level + 1]) {
+            return "bad levels";
+        }
+    }
+    if (format == TableFormat::FLAT5 && header->size != sizeof(uint16_t) * ((size_t)flat5_size(deck_size) + 2)) {
+        return "wrong size of a flat table";
+    }
+    if (format == TableFormat::RANK_HASH && header->size != sizeof(RankHashTable)) {
+        return "wrong size of a rank hash table";
+    }
+    if (format != TableFormat::COMPACT && format != TableFormat::FLAT5 && format != TableFormat::RANK_HASH && ((size_t)header->levels[7] + 1) * (deck_size + 1) * sizeof(int) > header->size) {
+        return "levels out of the table";
+    }
+    return "";
+}
 
-    FILE* fout = fopen(file_name.c_str(), "wb");
-    if (!fout) {
-        throw Error("Write to file failed: " + file_name);
+static TableFormat truncated_format(int max_cards) {
+    if (max_cards != 5 && max_cards != 6) {
+        throw Error("Tables can be truncated after 5 or 6 cards, not " + std::to_string(max_cards));
     }
-    std::fwrite(&HR[0], sizeof(int) * HR.size(), 1, fout);
-    fclose(fout);
+    return max_cards == 5 ? TableFormat::FIVE_CARDS : TableFormat::SIX_CARDS;
 }
 
-void generate(const std::string& file_name) {
-    int     IDslot, card = 0;
-    int64_t ID;
+static bool verify_table(const char* file, Verify verify) {
+    const TableHeader* header = reinterpret_cast<const TableHeader*>(file);
+    const uint8_t*     data   = reinterpret_cast<const uint8_t*>(file) + sizeof(TableHeader);
+    if (verify == Verify::SAMPLED) {
+        return table_checksum(data, header->size, TABLE_SAMPLE_STRIDE) == header->sampled_checksum;
+    }
+    return table_checksum(data, header->size, 1) == header->checksum;
+}
 
-    clock_t timer = clock(); // remember when I started
+// Table generated straight into a mapped temp file next to file_name. publish()
+// renames it into place, so readers never map a partially written table; the
+// pages stay in the page cache for them. Dropped unpublished, the temp file is removed.
+class TableWriter {
+public:
+    TableWriter(const std::string& file_name, size_t size)
+        : file_name_(file_name)
+        , temp_name_(file_name + ".tmp." + std::to_string(getpid()))
+    {
+        fd_ = open(temp_name_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            throw Error("Write to file failed: " + temp_name_);
+        }
 
-    std::vector<int> HR(JOKER_HAND_RANKS_COUNT);
-    std::vector<int64_t> IDs(JOKER_IDS_COUNT);
+        std::error_code error;
+        if (ftruncate(fd_, size) == 0) {
+            map_.map(fd_, error);
+        }
+        if (!map_.is_mapped()) {
+            close(fd_);
+            unlink(temp_name_.c_str());
+            throw Error("Map file failed: " + temp_name_);
+        }
+    }
 
-    int     numIDs   = 1;
-    int     numcards = 0;
-    int     maxHR    = 0;
-    int64_t maxID    = 0;
+    ~TableWriter() {
+        if (fd_ >= 0) {
+            map_.unmap();
+            close(fd_);
+            unlink(temp_name_.c_str());
+        }
+    }
 
-    // step through the ID array - always shifting the current ID and
-    // adding 52 cards to the end of the array.
-    // when I am at 7 cards put the Hand Rank in!!
-    // stepping through the ID array is perfect!!
-    // SA: indeed
+    TableWriter(const TableWriter&) = delete;
+    TableWriter& operator=(const TableWriter&) = delete;
 
-    int IDnum;
+    char* data() { return map_.data(); }
 
-    _PDEBUG("Getting Card IDs!");
+    // Publishes the first size bytes, by default all of them.
+    void publish(size_t size = 0) {
+        std::error_code error;
+        map_.sync(error);
+        size_t mapped = map_.size();
+        map_.unmap();
 
-    // Jmd: Okay, this loop is going to fill up the IDs[] array which has
-    // 612,967 slots. as this loops through and find new combinations it
-    // adds them to the end. I need this list to be stable when I set the
-    // handranks (next set)  (I do the insertion sort on new IDs these)
-    // so I had to get the IDs first and then set the handranks
-    // SA: will stop if there are no combinations left
-    for (IDnum = 0; IDs[IDnum] || IDnum == 0; IDnum++) {
-        // start at 1 so I have a zero catching entry (just in case)
-        for (card = 1; card < JOKER_DECK_SIZE + 1; card++) {
-            // the ids above contain cards upto the current card.  Now add a new card
-            ID = make_id(IDs[IDnum], card, numcards, true); // get the new ID for it
-            //count_jokercombs(ID, jokercombs);
-            // and save it in the list if I am not on the 7th card
-            if (numcards < 7)
-                save_id(ID, IDs, maxID, numIDs);
+        bool written = !error && (size == 0 || size == mapped || ftruncate(fd_, size) == 0) && fsync(fd_) == 0;
+        close(fd_);
+        fd_ = -1;
+        if (!written || rename(temp_name_.c_str(), file_name_.c_str()) != 0) {
+            unlink(temp_name_.c_str());
+            throw Error("Write to file failed: " + file_name_);
         }
-        // show progress -- this counts up to 612976
-        // SA: if there are jokers, counts up to ~1M
-        _PPRINT("\rID - %d %llX %llX", IDnum, ID, IDs[IDnum+1]);
     }
 
-    _PDEBUG("\nSetting HandRanks! %d", IDnum);
-
-    // this is as above, but will not add anything to the ID list, so it is stable
-    for (IDnum = 0; IDs[IDnum] || IDnum == 0; IDnum++) {
-        // start at 1 so I have a zero catching entry (just in case)
-        for (card = 1; card < JOKER_DECK_SIZE + 1; card++) {
-            ID = make_id(IDs[IDnum], card, numcards, true);
-
-            if (numcards < 7) {
-                // when in the index mode (< 7 cards) get the id to save
-                IDslot = save_id(ID, IDs, maxID, numIDs) * (JOKER_DECK_SIZE + 1) + JOKER_DECK_SIZE + 1;
+private:
+    std::string      file_name_;
+    std::string      temp_name_;
+    int              fd_;
+    mio::mmap_sink   map_;
+};
+
+
+// Merges the nodes with identical rows, which makes the trie a minimized DAG:
+// the rows of a level are deduplicated once the pointers of their children are,
+// so it goes from the 6 card level up. Lookups don't change. The kept rows are
+// moved down in place in the same level order, returns their number; the rows
+// after them are left over for the caller to cut off.
+static int minimize_table(int* HR, int deck_size, const std::vector<int>& levels, int leaf = 6) {
+    const int row    = deck_size + 1;
+    const int numIDs = levels[7];
+
+    struct RowHash {
+        int row;
+        size_t operator()(const int* entries) const {
+            uint64_t hash = 0xcbf29ce484222325;
+            for (int i = 0; i < row; i++) {
+                hash = (hash ^ (uint32_t)entries[i]) * 0x100000001b3;
             }
-            else {
-                // if I am at the 7th card, get the equivalence class ("hand rank") to save
-                IDslot = do_joker_eval(ID, numcards);
+            return hash;
+        }
+    };
+    struct RowEqual {
+        int row;
+        bool operator()(const int* a, const int* b) const { return memcmp(a, b, row * sizeof(int)) == 0; }
+    };
+
+    // same[IDnum] is the first node of the level with the same row
+    std::vector<int> same(numIDs);
+    for (int level = 6; level >= 0; level--) {
+        std::unordered_map<const int*, int, RowHash, RowEqual> rows(levels[level + 1] - levels[level], RowHash{row}, RowEqual{row});
+        for (int IDnum = levels[level]; IDnum < levels[level + 1]; IDnum++) {
+            int* children = &HR[(IDnum + 1) * row];
+            if (level < leaf) {
+                for (int card = 1; card < row; card++) {
+                    if (children[card]) {
+                        children[card] = (same[children[card] / row - 1] + 1) * row;
+                    }
+                }
             }
-
-            // find where to put it
-            maxHR     = IDnum * (JOKER_DECK_SIZE + 1) + card + JOKER_DECK_SIZE + 1;
-            // and save the pointer to the next card or the handrank
-            HR[maxHR] = IDslot;
-            //_PDEBUG("ID0 - %d %d", IDnum, maxHR); // show the progress -- counts to 612976 again
+            same[IDnum] = rows.emplace(children, IDnum).first->second;
         }
+    }
 
-        if (numcards == 6 || numcards == 7) {
-            // an extra, If you want to know what the handrank when there is 5 or 6 cards
-            // you can just do HR[u3] or HR[u4] from below code for Handrank of the 5 or
-            // 6 card hand
-            // this puts the above handrank into the array
-            HR[IDnum * (JOKER_DECK_SIZE + 1) + JOKER_DECK_SIZE + 1] = do_joker_eval(IDs[IDnum], numcards);
-            //_PDEBUG("ID6 - %d %d", IDnum, IDnum * (DECK_SIZE + 1) + DECK_SIZE + 1); // show the progress -- counts to 612976 again
+    std::vector<int> renumbered(numIDs);
+    int kept = 0;
+    for (int IDnum = 0; IDnum < numIDs; IDnum++) {
+        if (same[IDnum] == IDnum) {
+            renumbered[IDnum] = kept++;
         }
-
-        _PPRINT("\rID - %d", IDnum); // show the progress -- counts to 612976 again
     }
 
-    _PDEBUG("\nNumber IDs = %d\nmaxHR = %d", numIDs, maxHR); // for warm fuzzys
+    for (int IDnum = 0; IDnum < numIDs; IDnum++) {
+        if (same[IDnum] != IDnum) {
+            continue;
+        }
 
-    timer = clock() - timer; // end the timer
+        int* children = &HR[(IDnum + 1) * row];
+        if (IDnum < levels[leaf]) {
+            for (int card = 1; card < row; card++) {
+                if (children[card]) {
+                    children[card] = (renumbered[children[card] / row - 1] + 1) * row;
+                }
+            }
+        }
+        memmove(&HR[(renumbered[IDnum] + 1) * row], children, row * sizeof(int));
+    }
+    return kept;
+}
 
-    _PDEBUG("Training seconds = %.2f", (float)timer / CLOCKS_PER_SEC);
+// How often lookups reach every node: with no profile a deal goes on to every
+// valid next card with the same probability, otherwise the profile hands are walked.
+static std::vector<double> row_weights(const int* HR, int deck_size, const std::vector<int>& levels, const std::vector<std::vector<int>>& profile) {
+    const int row = deck_size + 1;
+
+    std::vector<double> weights(levels[7], 0.0);
+    if (!profile.empty()) {
+        for (const std::vector<int>& hand : profile) {
+            int p = row;
+            for (size_t i = 0; i < hand.size() && i < 6 && p; i++) {
+                p = HR[p + hand[i]];
+                if (p) {
+                    weights[p / row - 1] += 1;
+                }
+            }
+        }
+        return weights;
+    }
 
-    FILE* fout = fopen(file_name.c_str(), "wb");
-    if (!fout) {
-        throw Error("Write to file failed: " + file_name);
+    weights[0] = 1;
+    for (int IDnum = 0; IDnum < levels[6]; IDnum++) {
+        const int* children = &HR[(IDnum + 1) * row];
+        int        valid    = 0;
+        for (int card = 1; card < row; card++) {
+            valid += children[card] != 0;
+        }
+        for (int card = 1; card < row; card++) {
+            if (children[card]) {
+                weights[children[card] / row - 1] += weights[IDnum] / valid;
+            }
+        }
     }
-    std::fwrite(&HR[0], sizeof(int) * HR.size(), 1, fout);
-    fclose(fout);
+    return weights;
 }
 
-void init() try {
-    std::string ranks_file_name = RANKS_FILE_NAME;
+// Orders the rows of every level by descending weight in place. The levels stay
+// where they are, so the first ones remain contiguous; the root stays first.
+static void relayout_rows(int* HR, int deck_size, const std::vector<int>& levels, const std::vector<double>& weights) {
+    const int row    = deck_size + 1;
+    const int numIDs = levels[7];
 
-    std::error_code error;
-    ranks_map.map(ranks_file_name, error);
-    if (!error) {
-        _PDEBUG("Mapped: %.*s", (int)ranks_file_name.length(), ranks_file_name.data());
-        return;
+    std::vector<int> order(numIDs);
+    for (int IDnum = 0; IDnum < numIDs; IDnum++) {
+        order[IDnum] = IDnum;
+    }
+    for (int level = 0; level < 7; level++) {
+        std::stable_sort(order.begin() + levels[level], order.begin() + levels[level + 1],
+                         [&](int a, int b) { return weights[a] > weights[b]; });
     }
 
-    _PDEBUG("Generating new file: %.*s", (int)ranks_file_name.length(), ranks_file_name.data());
+    std::vector<int> renumbered(numIDs);
+    for (int IDnum = 0; IDnum < numIDs; IDnum++) {
+        renumbered[order[IDnum]] = IDnum;
+    }
 
-    // use standard handranks as lookup service
-    std::string standard_ranks_file_name = STANDARD_RANKS_FILE_NAME;
-    standard_ranks_map.map(standard_ranks_file_name, error);
-    if (error) {
-        _PDEBUG("Generating new file: %.*s", (int)standard_ranks_file_name.length(), standard_ranks_file_name.data());
-        generate_standard(standard_ranks_file_name);
-        standard_ranks_map.map(standard_ranks_file_name, error);
-        if (error) {
-            throw Error("Map file failed");
-            abort();
+    for (int IDnum = 0; IDnum < levels[6]; IDnum++) {
+        int* children = &HR[(IDnum + 1) * row];
+        for (int card = 1; card < row; card++) {
+            if (children[card]) {
+                children[card] = (renumbered[children[card] / row - 1] + 1) * row;
+            }
         }
     }
 
-    _PDEBUG("Mapped: %.*s", (int)standard_ranks_file_name.length(), standard_ranks_file_name.data());
-
-    // can't mmap, generate new file
-    generate(ranks_file_name);
-
-    ranks_map.map(ranks_file_name, error);
-    if (error) {
-        throw Error("Map file failed");
-        abort();
+    // follow the cycles of the permutation with one spare row
+    std::vector<int>  spare(row);
+    std::vector<bool> moved(numIDs, false);
+    for (int first = 0; first < numIDs; first++) {
+        if (moved[first] || order[first] == first) {
+            continue;
+        }
+        memcpy(&spare[0], &HR[(first + 1) * row], row * sizeof(int));
+        int IDnum = first;
+        while (order[IDnum] != first) {
+            memcpy(&HR[(IDnum + 1) * row], &HR[(order[IDnum] + 1) * row], row * sizeof(int));
+            moved[IDnum] = true;
+            IDnum        = order[IDnum];
+        }
+        memcpy(&HR[(IDnum + 1) * row], &spare[0], row * sizeof(int));
+        moved[IDnum] = true;
     }
 }
-catch(Error& e) {
-    fprintf(stderr, "Init failed: %s", e.what());
-    abort();
-}
 
-void fini() {
-    ranks_map.unmap();
-}
+template <typename Eval>
+static void generate_table(const std::string& file_name, int deck_size, int64_t ids_count, int hand_ranks_count, bool with_joker, Eval eval, int threads,
+                           bool relayout) {
+    auto start = std::chrono::steady_clock::now(); // remember when I started
 
-//   This routine initializes the deck.  A deck of cards is
-//   simply an integer array of length 52 (no jokers).  This
-//   array is populated with each card, using the following
-//   scheme:
-//
-//   An integer is made up of four bytes.  The high-order
-//   bytes are used to hold the rank bit pattern, whereas
-//   the low-order bytes hold the suit/rank/prime value
-//   of the card.
-//
-//   +--------+--------+--------+--------+
-//   |xxxbbbbb|bbbbbbbb|cdhsrrrr|xxpppppp|
-//   +--------+--------+--------+--------+
-//
-//   p = prime number of rank (deuce=2,trey=3,four=5,five=7,...,ace=41)
-//   r = rank of card (deuce=0,trey=1,four=2,five=3,...,ace=12)
-//   cdhs = suit of card
-//   b = bit turned on depending on rank of card
-void init_deck(int* deck) {
-    int n = 0, suit = 0x8000;
-    for (int i = 0; i < 4; i++, suit >>= 1)
-        for (int j = 0; j < 13; j++, n++)
-            deck[n] = primes[j] | (j << 8) | suit | (1 << (16 + j));
-}
+    size_t size = sizeof(int) * hand_ranks_count;
+    TableWriter writer(file_name, sizeof(TableHeader) + size); // zero filled
+    int* HR = reinterpret_cast<int*>(writer.data() + sizeof(TableHeader));
+    std::vector<int64_t> IDs(ids_count);
 
-//  This routine will search a deck for a specific card
-//  (specified by rank/suit), and return the INDEX giving
-//  the position of the found card.  If it is not found,
-//  then it returns -1
-int find_card(int rank, int suit, int* deck) {
-    for (int i = 0; i < 52; i++) {
-        int c = deck[i];
-        if ((c & suit) && (RANK(c) == rank))
-            return i;
-    }
-    return -1;
-}
+    _PDEBUG("Getting Card IDs!");
 
-//  This routine takes a deck and randomly mixes up the order of the cards.
-void shuffle_deck(int* deck, int size) {
-    std::random_shuffle(deck, deck + size);
-}
+    int numIDs = discover_ids(IDs, deck_size, with_joker);
 
-std::string print_hand(int* hand, int size) {
-    static const char* ranks = "23456789TJQKA";
-    std::string result;
-    result.reserve(size*2);
-    for (int i = 0; i < size; i++) {
-        char suit;
-        if (hand[i] & 0x8000)
-            suit = 'c';
-        else if (hand[i] & 0x4000)
-            suit = 'd';
-        else if (hand[i] & 0x2000)
-            suit = 'h';
-        else
-            suit = 's';
+    auto discovered = std::chrono::steady_clock::now();
 
-        result.push_back(ranks[(hand[i] >> 8) & 0xF]);
-        result.push_back(suit);
-    }
-    return result;
-}
+    _PDEBUG("\nSetting HandRanks! %d", numIDs);
 
-unsigned find_fast(unsigned u) {
-    unsigned a, b, r;
-    u += 0xE91AAA35;
-    u ^= u >> 16;
-    u += u << 8;
-    u ^= u >> 4;
-    b = (u >> 8) & 0x1FF;
-    a = (u + (u << 2)) >> 19;
-    r = a ^ hash_adjust[b];
-    return r;
-}
+    tbb::task_arena arena(threads > 0 ? threads : tbb::task_arena::automatic);
+    arena.execute([&] {
+        set_hand_ranks(HR, IDs, numIDs, deck_size, with_joker, eval);
+    });
 
-int eval_5cards(int c1, int c2, int c3, int c4, int c5) {
-    int q = (c1 | c2 | c3 | c4 | c5) >> 16;
+    auto stop = std::chrono::steady_clock::now(); // end the timer
 
-    // check for flushes and straight flushes
-    if (c1 & c2 & c3 & c4 & c5 & 0xF000)
-        return flushes[q];
+    int maxHR = (numIDs - 1) * (deck_size + 1) + deck_size + deck_size + 1;
+    _PDEBUG("\nNumber IDs = %d\nmaxHR = %d", numIDs, maxHR); // for warm fuzzys
 
-    // check for straights and high card hands
-    short s;
-    if ((s = unique5[q]))
-        return s;
+    _PDEBUG("Training seconds = %.2f (IDs %.2f, HandRanks %.2f on %d threads)",
+            std::chrono::duration<double>(stop - start).count(),
+            std::chrono::duration<double>(discovered - start).count(),
+            std::chrono::duration<double>(stop - discovered).count(),
+            arena.max_concurrency());
 
-    return hash_values[find_fast((c1 & 0xFF) * (c2 & 0xFF) * (c3 & 0xFF) * (c4 & 0xFF) * (c5 & 0xFF))];
-}
+    int kept = minimize_table(HR, deck_size, table_levels(HR, deck_size, numIDs));
+    size     = sizeof(int) * (size_t)(kept + 1) * (deck_size + 1);
+    _PDEBUG("Minimized to %d of %d rows, %zu bytes", kept, numIDs, size);
 
-int eval_5hand(const int* hand) {
-    int c1 = *hand++;
-    int c2 = *hand++;
-    int c3 = *hand++;
-    int c4 = *hand++;
-    int c5 = *hand;
-    return eval_5cards(c1, c2, c3, c4, c5);
+    std::vector<int> levels = table_levels(HR, deck_size, kept);
+    if (relayout) {
+        relayout_rows(HR, deck_size, levels, row_weights(HR, deck_size, levels, {}));
+    }
+    write_table_header(reinterpret_cast<uint8_t*>(writer.data()), TableFormat::FULL, deck_size, size, levels);
+    writer.publish(sizeof(TableHeader) + size);
 }
 
-// This is a non-optimized method of determining the best five-card hand possible out of six cards.
-// If 6 cards I would like to find Result for them
-// Cactus Key is 1 = highest - 7362 lowest
-// I need to get the min for the permutations
-int eval_6hand(const int* hand) {
-    int subhand[5];
-    int best = 9999;
-    //std::atomic<int> best;
-    //best = 9999;
-    //tbb::parallel_for(0, 6, [&](int i){
-    for (int i = 0; i < 6; i++) {
-        //int subhand[5];
-        for (int j = 0; j < 5; j++)
-            subhand[j] = hand[perm6[i][j]];
-        best = std::min(best, eval_5hand(subhand));
-    }
-    return best;
+// Number of threads from POKERLIB_THREADS, 0 - TBB default.
+static int env_threads() {
+    const char* threads = getenv("POKERLIB_THREADS");
+    return threads ? atoi(threads) : 0;
 }
 
-// This is a non-optimized method of determining the best five-card hand possible out of seven cards.
-int eval_7hand(const int* hand) {
-    int subhand[5];
-    int best = 9999;
-    //std::atomic<int> best;
-    //best = 9999;
-    //tbb::parallel_for(0, 21, [&](int i){
-        //int subhand[5];
-    for (int i = 0; i < 21; i++) {
-        for (int j = 0; j < 5; j++)
-            subhand[j] = hand[perm7[i][j]];
-        best = std::min(best, eval_5hand(subhand));
+// Exclusive flock() on a lock file, held until destruction. Works across processes
+// and across threads which open the file separately.
+class FileLock {
+public:
+    explicit FileLock(const std::string& file_name) : file_name_(file_name) {
+        for (;;) {
+            fd_ = open(file_name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd_ < 0) {
+                throw Error("Open lock file failed: " + file_name);
+            }
+            while (flock(fd_, LOCK_EX) != 0) {
+                if (errno != EINTR) {
+                    close(fd_);
+                    throw Error("Lock file failed: " + file_name);
+                }
+            }
+
+            // the previous holder may have removed the file, then the lock guards nothing
+            struct stat locked, current;
+            if (fstat(fd_, &locked) == 0 && stat(file_name.c_str(), &current) == 0 &&
+                locked.st_dev == current.st_dev && locked.st_ino == current.st_ino) {
+                break;
+            }
+            close(fd_);
+        }
     }
-    return best;
-}
 
-// Lookup of a poker hand, cards should be a pointer to an array
-// of integers each with value between 1 and DECK_SIZE inclusive.
-int standard_lookup(const int* cards, int size) {
-    const int* ranks = reinterpret_cast<const int*>(standard_ranks_map.data());
+    ~FileLock() {
+        flock(fd_, LOCK_UN);
+        close(fd_);
+    }
 
-    int p = STANDARD_DECK_SIZE + 1;
-    for (int i = 0; i < size; ++i) {
-        p = ranks[p + cards[i]];
+    // Removes the lock file while still holding it, waiters open a new one.
+    void remove() {
+        unlink(file_name_.c_str());
     }
 
-    if (size == 5 || size == 6) {
-        p = ranks[p];
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+
+private:
+    std::string file_name_;
+    int         fd_;
+};
+
+// Maps a table file, generating it first if it's missing or invalid and that's allowed.
+// Only one process generates a file, the others wait on file_name.lock, next to the
+// table, and map the result. The lock file is removed once the table is valid.
+template <typename Generate>
+static void map_table(mio::mmap_source& map, const std::string& file_name, TableFormat format, int deck_size, bool generate, Generate make) {
+    auto check = [&] {
+        std::error_code error;
+        map.unmap();
+        map.map(file_name, error);
+        return error ? std::string("can't map") : check_table_header(map.data(), map.size(), format, deck_size);
+    };
+
+    std::string invalid = check();
+    if (!invalid.empty()) {
+        if (!generate) {
+            throw Error("Map file failed: " + file_name + ", " + invalid);
+        }
+
+        FileLock lock(file_name + ".lock");
+        invalid = check(); // may be generated while we waited
+        if (!invalid.empty()) {
+            _PDEBUG("Generating new file: %.*s (%s)", (int)file_name.length(), file_name.data(), invalid.c_str());
+            map.unmap();
+            make();
+            invalid = check();
+            if (!invalid.empty()) {
+                throw Error("Map file failed: " + file_name + ", " + invalid);
+            }
+        }
+        lock.remove();
     }
 
-    return p;
+    _PDEBUG("Mapped: %.*s", (int)file_name.length(), file_name.data());
+}
+
+void generate_standard(const std::string& file_name, int threads, bool relayout) {
+    generate_table(file_name, STANDARD_DECK_SIZE, STANDARD_IDS_COUNT, STANDARD_HAND_RANKS_COUNT, false,
+                   [](int64_t ID, int numcards) { return do_eval(ID, numcards); }, threads, relayout);
 }
 
-// Lookup of a poker hand, cards should be a pointer to an array
-// of integers each with value between 1 and DECK_SIZE inclusive.
-int lookup(const int* cards, int size) {
-    const int* ranks = reinterpret_cast<const int*>(ranks_map.data());
+void generate(const std::string& file_name, int threads, const std::string& standard_file_name, bool relayout) {
+    // use standard handranks as lookup service
+    mio::mmap_source standard_ranks_map;
+    map_table(standard_ranks_map, standard_file_name, TableFormat::FULL, STANDARD_DECK_SIZE, true, [&] {
+        generate_standard(standard_file_name, threads, relayout);
+    });
+    JokerEvalTable table(reinterpret_cast<const int*>(standard_ranks_map.data() + sizeof(TableHeader)),
+                         standard_ranks_map.size() - sizeof(TableHeader));
+
+    generate_table(file_name, JOKER_DECK_SIZE, JOKER_IDS_COUNT, JOKER_HAND_RANKS_COUNT, true,
+                   [&table](int64_t ID, int numcards) { return do_joker_eval(ID, numcards, table); }, threads, relayout);
+}
 
-    int p = JOKER_DECK_SIZE + 1;
-    for (int i = 0; i < size; ++i) {
-        p = ranks[p + cards[i]];
+void relayout(const std::string& in_file, const std::string& out_file, const std::vector<std::vector<int>>& profile) {
+    mio::mmap_source in;
+    std::error_code  error;
+    in.map(in_file, error);
+    if (error) {
+        throw Error("Map file failed: " + in_file);
     }
 
-    if (size == 5 || size == 6) {
-        p = ranks[p];
+    const TableHeader* header    = reinterpret_cast<const TableHeader*>(in.data());
+    int                deck_size = in.size() >= sizeof(TableHeader) ? (int)header->deck_size : 0;
+    std::string        invalid   = check_table_header(in.data(), in.size(), TableFormat::FULL, deck_size);
+    if (!invalid.empty()) {
+        throw Error("Map file failed: " + in_file + ", " + invalid);
     }
 
-    return p;
+    TableWriter writer(out_file, in.size());
+    memcpy(writer.data(), in.data(), in.size());
+    int* HR = reinterpret_cast<int*>(writer.data() + sizeof(TableHeader));
+
+    std::vector<int> levels(header->levels, header->levels + 8);
+    relayout_rows(HR, deck_size, levels, row_weights(HR, deck_size, levels, profile));
+    _PDEBUG("Relayout of %d rows, %s weights", levels[7], profile.empty() ? "uniform" : "profile");
+
+    write_table_header(reinterpret_cast<uint8_t*>(writer.data()), TableFormat::FULL, deck_size, header->size, levels);
+    writer.publish();
+}
+
+#ifndef POKERLIB_DATA_DIR
+#define POKERLIB_DATA_DIR "" // set by CMake to the installed tables
+#endif
+
+// Directory of the default tables: POKERLIB_DATA_DIR from the environment, otherwise
+// the install dir if the tables were built and installed there, otherwise the working one.
+static std::string table_dir() {
+    const char* dir = getenv("POKERLIB_DATA_DIR");
+    if (dir) {
+        return dir;
+    }
+
+    std::string installed = POKERLIB_DATA_DIR;
+    if (!installed.empty() && access((installed + "/" + RANKS_FILE_NAME).c_str(), R_OK) == 0) {
+        return installed;
+    }
+    return "";
+}
+
+EvaluatorOptions EvaluatorOptions::from_env() {
+    EvaluatorOptions options;
+
+    options.embedded = has_embedded_tables() && !getenv("POKERLIB_DATA_DIR");
+
+    std::string dir = table_dir();
+    if (!dir.empty()) {
+        options.ranks_file          = dir + "/" + RANKS_FILE_NAME;
+        options.standard_ranks_file = dir + "/" + STANDARD_RANKS_FILE_NAME;
+        options.compact_ranks_file  = dir + "/" + COMPACT_RANKS_FILE_NAME;
+    }
+
+    options.compact   = getenv("POKERLIB_COMPACT") != nullptr;
+    options.relayout  = getenv("POKERLIB_RELAYOUT") != nullptr;
+    options.flat5     = getenv("POKERLIB_FLAT5") != nullptr;
+    options.rank_hash = getenv("POKERLIB_RANK_HASH") != nullptr;
+
+    const char* max_cards = getenv("POKERLIB_MAX_CARDS");
+    if (max_cards) {
+        options.max_cards = atoi(max_cards);
+        if (options.max_cards != 7) {
+            truncated_format(options.max_cards); // throws for anything but 5 or 6
+        }
+    }
+    options.threads = env_threads();
+
+    const char* huge_pages = getenv("POKERLIB_HUGE_PAGES");
+    if (huge_pages) {
+        options.pages = std::string(huge_pages) == "hugetlb" ? PageMode::HUGETLB : PageMode::TRANSPARENT_HUGE;
+    }
+
+    const char* verify = getenv("POKERLIB_VERIFY");
+    if (verify) {
+        std::string name = verify;
+        if (name == "sampled")
+            options.verify = Verify::SAMPLED;
+        else if (name == "full")
+            options.verify = Verify::FULL;
+        else
+            throw Error("Unknown POKERLIB_VERIFY: " + name);
+    }
+
+    const char* warm = getenv("POKERLIB_WARM_UP");
+    if (warm) {
+        std::string name = warm;
+        if (name == "populate")
+            options.warm_up = WarmUp::POPULATE;
+        else if (name == "willneed")
+            options.warm_up = WarmUp::WILLNEED;
+        else if (name == "mlock")
+            options.warm_up = WarmUp::MLOCK;
+        else if (name == "touch")
+            options.warm_up = WarmUp::TOUCH;
+        else
+            throw Error("Unknown POKERLIB_WARM_UP: " + name);
+    }
+    return options;
+}
+
+Evaluator::Evaluator(const Options& options) : options_(options) {}
+
+Evaluator::~Evaluator() {
+    unload();
+}
+
+#ifdef POKERLIB_EMBEDDED_TABLES
+// Linked in by embedded_tables.S, every table starts with its TableHeader.
+extern "C" const char pokerlib_embedded_ranks[];
+extern "C" const char pokerlib_embedded_standard_ranks[];
+
+static const char* embedded_ranks()          { return pokerlib_embedded_ranks; }
+static const char* embedded_standard_ranks() { return pokerlib_embedded_standard_ranks; }
+#else
+static const char* embedded_ranks()          { return nullptr; }
+static const char* embedded_standard_ranks() { return nullptr; }
+#endif
+
+bool has_embedded_tables() {
+    return embedded_ranks() != nullptr;
+}
+
+// Points the image at the embedded table if asked for and there is one, otherwise maps the file.
+template <typename Generate>
+void Evaluator::load_image(TableImage& image, const std::string& file_name, const char* embedded, TableFormat format, int deck_size, Generate make) {
+    if (options_.embedded && embedded) {
+        size_t      size    = sizeof(TableHeader) + reinterpret_cast<const TableHeader*>(embedded)->size;
+        std::string invalid = check_table_header(embedded, size, format, deck_size);
+        if (!invalid.empty()) {
+            throw Error("Embedded table failed: " + invalid);
+        }
+        image.data = embedded;
+        image.size = size;
+        return;
+    }
+
+    map_table(image.map, file_name, format, deck_size, options_.generate, make);
+    image.data = image.map.data();
+    image.size = image.map.size();
+}
+
+void Evaluator::load() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    load_lookup_locked();
+}
+
+// The tables lookup() reads with the options.
+void Evaluator::load_lookup_locked() {
+    if (options_.flat5) {
+        load_flat5_locked(false);
+        if (options_.max_cards == 5) {
+            return; // nothing else is read
+        }
+    }
+    if (options_.rank_hash) {
+        load_rank_hash_locked();
+        return;
+    }
+    if (options_.max_cards < 7)
+        load_truncated_locked(false);
+    else if (options_.compact)
+        load_compact_locked();
+    else
+        load_locked();
+}
+
+void Evaluator::load_full(bool standard) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (standard)
+        load_standard_locked();
+    else
+        load_locked();
+}
+
+void Evaluator::load_truncated(bool standard) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    load_truncated_locked(standard);
+}
+
+void Evaluator::load_flat5(bool standard) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    load_flat5_locked(standard);
+}
+
+void Evaluator::load_rank_hash() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    load_rank_hash_locked();
+}
+
+void Evaluator::load_compact() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    load_compact_locked();
+}
+
+void Evaluator::load_locked() {
+    if (ranks_.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    load_image(ranks_image_, options_.ranks_file, embedded_ranks(), TableFormat::FULL, JOKER_DECK_SIZE, [&] {
+        generate(options_.ranks_file, options_.threads, options_.standard_ranks_file, options_.relayout);
+    });
+    verify_locked(ranks_image_);
+
+    ranks_.store(reinterpret_cast<const int*>(ranks_image_.data + sizeof(TableHeader)), std::memory_order_release);
+
+    prepare_locked();
+}
+
+// Applies options.pages and options.warm_up to the tables loaded so far.
+void Evaluator::prepare_locked() {
+    if (options_.pages != PageMode::DEFAULT) {
+        map_huge_pages_locked(options_.pages == PageMode::HUGETLB);
+    }
+    if (options_.warm_up != WarmUp::NONE) {
+        warm_up_locked(options_.warm_up, options_.threads);
+    }
+}
+
+void Evaluator::load_standard() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (options_.flat5) {
+        load_flat5_locked(true);
+        if (options_.max_cards == 5) {
+            return;
+        }
+    }
+    if (options_.rank_hash) {
+        load_rank_hash_locked();
+        return;
+    }
+    if (options_.max_cards < 7)
+        load_truncated_locked(true);
+    else
+        load_standard_locked();
+}
+
+void Evaluator::load_standard_locked() {
+    if (standard_ranks_.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    load_image(standard_ranks_image_, options_.standard_ranks_file, embedded_standard_ranks(), TableFormat::FULL, STANDARD_DECK_SIZE, [&] {
+        generate_standard(options_.standard_ranks_file, options_.threads, options_.relayout);
+    });
+    verify_locked(standard_ranks_image_);
+
+    standard_ranks_.store(reinterpret_cast<const int*>(standard_ranks_image_.data + sizeof(TableHeader)), std::memory_order_release);
+}
+
+// Maps the full table for a while to make another table from it: use(ranks, size).
+template <typename Use>
+void Evaluator::use_full_table(bool standard, Use use) {
+    TableImage full;
+    if (standard) {
+        load_image(full, options_.standard_ranks_file, embedded_standard_ranks(), TableFormat::FULL, STANDARD_DECK_SIZE, [&] {
+            generate_standard(options_.standard_ranks_file, options_.threads, options_.relayout);
+        });
+    }
+    else {
+        load_image(full, options_.ranks_file, embedded_ranks(), TableFormat::FULL, JOKER_DECK_SIZE, [&] {
+            generate(options_.ranks_file, options_.threads, options_.standard_ranks_file, options_.relayout);
+        });
+    }
+    use(reinterpret_cast<const int*>(full.data + sizeof(TableHeader)), full.size - sizeof(TableHeader));
+}
+
+// Maps the compact joker table. It's made from the full one, which is mapped
+// only to generate it.
+void Evaluator::load_compact_locked() {
+    if (compact_.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    load_image(compact_ranks_image_, options_.compact_ranks_file, nullptr, TableFormat::COMPACT, JOKER_DECK_SIZE, [&] {
+        use_full_table(false, [&](const int* full, size_t size) {
+            generate_compact(options_.compact_ranks_file, full, size);
+        });
+    });
+    verify_locked(compact_ranks_image_);
+
+    compact_.store(compact_ranks_image_.data + sizeof(TableHeader), std::memory_order_release);
+
+    prepare_locked();
+}
+
+// Maps the table cut after max_cards cards. It's made from the full one, which
+// is mapped only to generate it.
+void Evaluator::load_truncated_locked(bool standard) {
+    std::atomic<const int*>& ranks = standard ? truncated_standard_ranks_ : truncated_ranks_;
+    if (ranks.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    TableImage&        image     = standard ? truncated_standard_ranks_image_ : truncated_ranks_image_;
+    const std::string& full_file = standard ? options_.standard_ranks_file : options_.ranks_file;
+    int                deck_size = standard ? STANDARD_DECK_SIZE : JOKER_DECK_SIZE;
+    std::string        file_name = truncated_file_name(full_file, options_.max_cards);
+
+    load_image(image, file_name, nullptr, truncated_format(options_.max_cards), deck_size, [&] {
+        use_full_table(standard, [&](const int* full, size_t size) {
+            generate_truncated(file_name, full, size, deck_size, options_.max_cards);
+        });
+    });
+    verify_locked(image);
+
+    ranks.store(reinterpret_cast<const int*>(image.data + sizeof(TableHeader)), std::memory_order_release);
+
+    prepare_locked();
+}
+
+void Evaluator::load_flat5_locked(bool standard) {
+    std::atomic<const uint16_t*>& ranks = standard ? flat5_standard_ranks_ : flat5_ranks_;
+    if (ranks.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    TableImage& image     = standard ? flat5_standard_ranks_image_ : flat5_ranks_image_;
+    int         deck_size = standard ? STANDARD_DECK_SIZE : JOKER_DECK_SIZE;
+    std::string file_name = flat5_file_name(standard ? options_.standard_ranks_file : options_.ranks_file);
+
+    load_image(image, file_name, nullptr, TableFormat::FLAT5, deck_size, [&] {
+        use_full_table(standard, [&](const int* full, size_t) {
+            generate_flat5(file_name, full, deck_size);
+        });
+    });
+    verify_locked(image);
+
+    ranks.store(reinterpret_cast<const uint16_t*>(image.data + sizeof(TableHeader)), std::memory_order_release);
+
+    prepare_locked();
+}
+
+void Evaluator::load_rank_hash_locked() {
+    if (rank_hash_.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    std::string file_name = rank_hash_file_name(options_.ranks_file);
+    load_image(rank_hash_image_, file_name, nullptr, TableFormat::RANK_HASH, JOKER_DECK_SIZE, [&] {
+        use_full_table(false, [&](const int* full, size_t) {
+            generate_rank_hash(file_name, full);
+        });
+    });
+    verify_locked(rank_hash_image_);
+
+    rank_hash_.store(reinterpret_cast<const RankHashTable*>(rank_hash_image_.data + sizeof(TableHeader)), std::memory_order_release);
+
+    prepare_locked();
+}
+
+void Evaluator::verify_locked(const TableImage& image) {
+    if (options_.verify == Verify::NONE) {
+        return;
+    }
+
+    Verify verify = options_.verify;
+    const char* file = image.data;
+    verifications_.push_back(std::async(std::launch::async, [file, verify] {
+        bool valid = verify_table(file, verify);
+        if (!valid) {
+            _PDEBUG("Table checksum mismatch: %s", verify == Verify::SAMPLED ? "sampled" : "full");
+        }
+        return valid;
+    }).share());
+}
+
+bool Evaluator::verified() {
+    std::vector<std::shared_future<bool>> verifications;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        verifications = verifications_;
+    }
+
+    bool valid = true;
+    for (auto& verification : verifications) {
+        valid = verification.get() && valid;
+    }
+    return valid;
+}
+
+void Evaluator::unload() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    for (auto& verification : verifications_) {
+        verification.wait(); // reads the maps
+    }
+    verifications_.clear();
+
+    if (warm_up_stats_.mode == WarmUp::MLOCK) {
+        for (auto& region : regions()) {
+            munlock(region.first, region.second);
+        }
+    }
+
+    ranks_.store(nullptr);
+    standard_ranks_.store(nullptr);
+    truncated_ranks_.store(nullptr);
+    truncated_standard_ranks_.store(nullptr);
+    flat5_ranks_.store(nullptr);
+    flat5_standard_ranks_.store(nullptr);
+    rank_hash_.store(nullptr);
+    compact_.store(nullptr);
+    warm_up_stats_ = WarmUpStats();
+
+    for (TableImage* image : {&compact_ranks_image_, &standard_ranks_image_, &ranks_image_, &truncated_ranks_image_, &truncated_standard_ranks_image_,
+                              &flat5_ranks_image_, &flat5_standard_ranks_image_, &rank_hash_image_}) {
+        if (image->huge.data) {
+            munmap(image->huge.data, image->huge.size);
+            image->huge = HugePages();
+        }
+        image->map.unmap();
+        image->data = nullptr;
+        image->size = 0;
+    }
+}
+
+const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+// Copies a mapped table to anonymous memory backed by huge pages, returns DEFAULT if it can't.
+PageMode Evaluator::copy_to_huge_pages(TableImage& image, bool hugetlb) {
+    HugePages& huge = image.huge;
+    if (!image.data) {
+        return PageMode::DEFAULT;
+    }
+    if (huge.data) {
+        return huge.mode; // lookups may be reading the copy, keep it
+    }
+
+    struct statfs fs;
+    if (image.map.is_mapped() && fstatfs(image.map.file_handle(), &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC) {
+        return PageMode::HUGETLBFS; // already mapped with huge pages
+    }
+
+    size_t   size = (image.size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    void*    data = MAP_FAILED;
+    PageMode mode = PageMode::HUGETLB;
+
+    if (hugetlb) {
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (data == MAP_FAILED) {
+            _PDEBUG("%s failed, no huge pages reserved? Trying transparent huge pages", "MAP_HUGETLB");
+        }
+    }
+
+    if (data == MAP_FAILED) {
+        // transparent huge pages need a 2 MiB aligned region, so reserve one more page and trim
+        mode        = PageMode::TRANSPARENT_HUGE;
+        char* raw   = reinterpret_cast<char*>(mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (raw == MAP_FAILED) {
+            return PageMode::DEFAULT;
+        }
+        char* aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(raw) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+        if (aligned != raw) {
+            munmap(raw, aligned - raw);
+        }
+        munmap(aligned + size, raw + HUGE_PAGE_SIZE - aligned);
+
+        if (madvise(aligned, size, MADV_HUGEPAGE) != 0) {
+            _PDEBUG("%s failed, transparent huge pages are disabled?", "MADV_HUGEPAGE");
+            munmap(aligned, size);
+            return PageMode::DEFAULT;
+        }
+        data = aligned;
+    }
+
+    memcpy(data, image.data, image.size);
+    mprotect(data, size, PROT_READ);
+
+    huge.data = data;
+    huge.size = size;
+    huge.mode = mode;
+    return mode;
+}
+
+PageMode Evaluator::map_huge_pages(bool hugetlb) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    load_lookup_locked();
+    return map_huge_pages_locked(hugetlb);
+}
+
+// The table lookup() reads for most hand sizes with the options, see load_lookup_locked().
+const Evaluator::TableImage& Evaluator::lookup_image() const {
+    if (options_.flat5 && options_.max_cards == 5)
+        return flat5_ranks_image_;
+    if (options_.rank_hash)
+        return rank_hash_image_;
+    if (options_.max_cards < 7)
+        return truncated_ranks_image_;
+    if (options_.compact)
+        return compact_ranks_image_;
+    return ranks_image_;
+}
+
+// Copies every loaded table and points its lookups at the copy.
+PageMode Evaluator::map_huge_pages_locked(bool hugetlb) {
+    const TableImage* main = &lookup_image();
+    PageMode          mode = PageMode::DEFAULT;
+
+    auto copy = [&](TableImage& image, auto& table) {
+        PageMode copied = copy_to_huge_pages(image, hugetlb);
+        if (image.huge.data) {
+            table.store(reinterpret_cast<decltype(table.load())>(reinterpret_cast<const char*>(image.huge.data) + sizeof(TableHeader)), std::memory_order_release);
+        }
+        if (&image == main) {
+            mode = copied;
+        }
+    };
+    copy(ranks_image_, ranks_);
+    copy(standard_ranks_image_, standard_ranks_);
+    copy(compact_ranks_image_, compact_);
+    copy(truncated_ranks_image_, truncated_ranks_);
+    copy(truncated_standard_ranks_image_, truncated_standard_ranks_);
+    copy(flat5_ranks_image_, flat5_ranks_);
+    copy(flat5_standard_ranks_image_, flat5_standard_ranks_);
+    copy(rank_hash_image_, rank_hash_);
+
+    _PDEBUG("Rank table pages: %s", to_string(mode));
+    return mode;
+}
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22 // Linux 5.14
+#endif
+
+// Regions of the tables used by the lookups now, page aligned.
+std::vector<std::pair<const char*, size_t>> Evaluator::regions() const {
+    std::vector<std::pair<const char*, size_t>> regions;
+    for (const TableImage* image : {&ranks_image_, &standard_ranks_image_, &compact_ranks_image_, &truncated_ranks_image_, &truncated_standard_ranks_image_,
+                                    &flat5_ranks_image_, &flat5_standard_ranks_image_, &rank_hash_image_}) {
+        if (image->huge.data) {
+            regions.emplace_back(reinterpret_cast<const char*>(image->huge.data), image->huge.size);
+        }
+        else if (image->data) {
+            regions.emplace_back(image->data, image->size);
+        }
+    }
+    return regions;
+}
+
+static void touch_pages(const char* data, size_t size, size_t page_size) {
+    size_t pages = (size + page_size - 1) / page_size;
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, pages), [&](const tbb::blocked_range<size_t>& range) {
+        int sum = 0;
+        for (size_t i = range.begin(); i < range.end(); i++) {
+            sum += *reinterpret_cast<const volatile int*>(data + i * page_size);
+        }
+        (void)sum;
+    });
+}
+
+static size_t resident_pages(const char* data, size_t size, size_t page_size) {
+    std::vector<unsigned char> vec((size + page_size - 1) / page_size);
+    if (mincore(const_cast<char*>(data), size, &vec[0]) != 0) {
+        return 0;
+    }
+    return std::count_if(vec.begin(), vec.end(), [](unsigned char v) { return v & 1; });
+}
+
+WarmUpStats Evaluator::warm_up(WarmUp mode, int threads) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    load_lookup_locked();
+    return warm_up_locked(mode, threads);
+}
+
+WarmUpStats Evaluator::warm_up_locked(WarmUp mode, int threads) {
+    auto start = std::chrono::steady_clock::now();
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    auto   tables    = regions();
+
+    WarmUpStats stats;
+    stats.mode = mode;
+
+    tbb::task_arena arena(threads > 0 ? threads : tbb::task_arena::automatic);
+    for (auto& region : tables) {
+        char* data = const_cast<char*>(region.first);
+        size_t size = region.second;
+
+        if (mode == WarmUp::POPULATE && madvise(data, size, MADV_POPULATE_READ) != 0) {
+            _PDEBUG("%s failed, touching pages instead", "MADV_POPULATE_READ");
+            stats.mode = WarmUp::TOUCH;
+        }
+        else if (mode == WarmUp::WILLNEED && madvise(data, size, MADV_WILLNEED) != 0) {
+            _PDEBUG("%s failed", "MADV_WILLNEED");
+        }
+        else if (mode == WarmUp::MLOCK && mlock(data, size) != 0) {
+            _PDEBUG("%s failed, RLIMIT_MEMLOCK too low? Touching pages instead", "mlock");
+            stats.mode = WarmUp::TOUCH;
+        }
+
+        if (mode == WarmUp::TOUCH || stats.mode == WarmUp::TOUCH) {
+            arena.execute([&] {
+                touch_pages(data, size, page_size);
+            });
+        }
+    }
+
+    for (auto& region : tables) {
+        stats.pages    += (region.second + page_size - 1) / page_size;
+        stats.resident += resident_pages(region.first, region.second, page_size);
+    }
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    _PDEBUG("Warm up %s: %.3f seconds, %zu of %zu pages resident", to_string(stats.mode), stats.seconds, stats.resident, stats.pages);
+
+    warm_up_stats_ = stats;
+    return stats;
+}
+
+Evaluator& default_evaluator() {
+    static Evaluator evaluator(EvaluatorOptions::from_env());
+    return evaluator;
+}
+
+const int* get_table() {
+    return default_evaluator().table();
+}
+
+PageMode map_huge_pages(bool hugetlb) {
+    return default_evaluator().map_huge_pages(hugetlb);
+}
+
+PageMode page_mode() {
+    return default_evaluator().page_mode();
+}
+
+WarmUpStats warm_up(WarmUp mode, int threads) {
+    return default_evaluator().warm_up(mode, threads);
+}
+
+const WarmUpStats& warm_up_stats() {
+    return default_evaluator().warm_up_stats();
+}
+
+void init() {
+    default_evaluator().load();
+}
+
+void fini() {
+    default_evaluator().unload();
+}
+
+//   This routine initializes the deck.  A deck of cards is
+//   simply an integer array of length 52 (no jokers).  This
+//   array is populated with each card, using the following
+//   scheme:
+//
+//   An integer is made up of four bytes.  The high-order
+//   bytes are used to hold the rank bit pattern, whereas
+//   the low-order bytes hold the suit/rank/prime value
+//   of the card.
+//
+//   +--------+--------+--------+--------+
+//   |xxxbbbbb|bbbbbbbb|cdhsrrrr|xxpppppp|
+//   +--------+--------+--------+--------+
+//
+//   p = prime number of rank (deuce=2,trey=3,four=5,five=7,...,ace=41)
+//   r = rank of card (deuce=0,trey=1,four=2,five=3,...,ace=12)
+//   cdhs = suit of card
+//   b = bit turned on depending on rank of card
+void init_deck(int* deck) {
+    int n = 0, suit = 0x8000;
+    for (int i = 0; i < 4; i++, suit >>= 1)
+        for (int j = 0; j < 13; j++, n++)
+            deck[n] = primes[j] | (j << 8) | suit | (1 << (16 + j));
+}
+
+//  This routine will search a deck for a specific card
+//  (specified by rank/suit), and return the INDEX giving
+//  the position of the found card.  If it is not found,
+//  then it returns -1
+int find_card(int rank, int suit, int* deck) {
+    for (int i = 0; i < 52; i++) {
+        int c = deck[i];
+        if ((c & suit) && (RANK(c) == rank))
+            return i;
+    }
+    return -1;
+}
+
+//  This routine takes a deck and randomly mixes up the order of the cards.
+void shuffle_deck(int* deck, int size) {
+    std::random_shuffle(deck, deck + size);
+}
+
+std::string print_hand(int* hand, int size) {
+    static const char* ranks = "23456789TJQKA";
+    std::string result;
+    result.reserve(size*2);
+    for (int i = 0; i < size; i++) {
+        char suit;
+        if (hand[i] & 0x8000)
+            suit = 'c';
+        else if (hand[i] & 0x4000)
+            suit = 'd';
+        else if (hand[i] & 0x2000)
+            suit = 'h';
+        else
+            suit = 's';
+
+        result.push_back(ranks[(hand[i] >> 8) & 0xF]);
+        result.push_back(suit);
+    }
+    return result;
+}
+
+unsigned find_fast(unsigned u) {
+    unsigned a, b, r;
+    u += 0xE91AAA35;
+    u ^= u >> 16;
+    u += u << 8;
+    u ^= u >> 4;
+    b = (u >> 8) & 0x1FF;
+    a = (u + (u << 2)) >> 19;
+    r = a ^ hash_adjust[b];
+    return r;
+}
+
+int eval_5cards(int c1, int c2, int c3, int c4, int c5) {
+    int q = (c1 | c2 | c3 | c4 | c5) >> 16;
+
+    // check for flushes and straight flushes
+    if (c1 & c2 & c3 & c4 & c5 & 0xF000)
+        return flushes[q];
+
+    // check for straights and high card hands
+    short s;
+    if ((s = unique5[q]))
+        return s;
+
+    return hash_values[find_fast((c1 & 0xFF) * (c2 & 0xFF) * (c3 & 0xFF) * (c4 & 0xFF) * (c5 & 0xFF))];
+}
+
+int eval_5hand(const int* hand) {
+    int c1 = *hand++;
+    int c2 = *hand++;
+    int c3 = *hand++;
+    int c4 = *hand++;
+    int c5 = *hand;
+    return eval_5cards(c1, c2, c3, c4, c5);
+}
+
+// This is a non-optimized method of determining the best five-card hand possible out of six cards.
+// If 6 cards I would like to find Result for them
+// Cactus Key is 1 = highest - 7362 lowest
+// I need to get the min for the permutations
+int eval_6hand(const int* hand) {
+    int subhand[5];
+    int best = 9999;
+    //std::atomic<int> best;
+    //best = 9999;
+    //tbb::parallel_for(0, 6, [&](int i){
+    for (int i = 0; i < 6; i++) {
+        //int subhand[5];
+        for (int j = 0; j < 5; j++)
+            subhand[j] = hand[perm6[i][j]];
+        best = std::min(best, eval_5hand(subhand));
+    }
+    return best;
+}
+
+// This is a non-optimized method of determining the best five-card hand possible out of seven cards.
+int eval_7hand(const int* hand) {
+    int subhand[5];
+    int best = 9999;
+    //std::atomic<int> best;
+    //best = 9999;
+    //tbb::parallel_for(0, 21, [&](int i){
+        //int subhand[5];
+    for (int i = 0; i < 21; i++) {
+        for (int j = 0; j < 5; j++)
+            subhand[j] = hand[perm7[i][j]];
+        best = std::min(best, eval_5hand(subhand));
+    }
+    return best;
+}
+
+
+// Compact table: [CompactHeader][interior rows][leaf rows]
+// Interior rows are the nodes of up to 5 cards, 3 byte entries: the next node or,
+// for the 5 card nodes, the leaf row of the next card and their own rank in entry 0.
+// Leaf rows are the 6 card nodes, 2 byte entries: the 7 card hand ranks and their
+// own rank in entry 0. Row 0 of both parts is a zero row for duplicated cards.
+struct CompactHeader {
+    uint32_t interior_rows;
+    uint32_t leaf_rows;
+    uint64_t leaf_offset; // from the start of the table, 64 byte aligned
+};
+
+static inline int load24(const uint8_t* entry) {
+    uint32_t value;
+    memcpy(&value, entry, sizeof(value)); // interior rows are padded for this read
+    return (int)(value & 0xFFFFFF);
+}
+
+static inline void store24(uint8_t* entry, int value) {
+    entry[0] = (uint8_t)value;
+    entry[1] = (uint8_t)(value >> 8);
+    entry[2] = (uint8_t)(value >> 16);
+}
+
+void generate_compact(const std::string& file_name, const int* ranks, size_t size) {
+    const int row = JOKER_DECK_SIZE + 1;
+
+    std::vector<int> level_start = table_levels(ranks, JOKER_DECK_SIZE, (int)(size / sizeof(int) / row) - 1);
+    int              first_leaf  = level_start[6];
+    int              numIDs      = level_start[7];
+
+    CompactHeader header;
+    header.interior_rows = first_leaf + 1;
+    header.leaf_rows     = numIDs - first_leaf + 1;
+    size_t interior_size = (size_t)header.interior_rows * row * 3 + sizeof(uint32_t);
+    header.leaf_offset   = (sizeof(header) + interior_size + 63) / 64 * 64;
+
+    size_t      table_size = header.leaf_offset + (size_t)header.leaf_rows * row * sizeof(uint16_t);
+    TableWriter writer(file_name, sizeof(TableHeader) + table_size);
+    uint8_t*    table      = reinterpret_cast<uint8_t*>(writer.data() + sizeof(TableHeader));
+    memcpy(table, &header, sizeof(header));
+    uint8_t*  interior = &table[sizeof(header)];
+    uint16_t* leaves   = reinterpret_cast<uint16_t*>(&table[header.leaf_offset]);
+
+    tbb::parallel_for(tbb::blocked_range<int>(0, numIDs), [&](const tbb::blocked_range<int>& range) {
+        for (int IDnum = range.begin(); IDnum != range.end(); IDnum++) {
+            const int* children = &ranks[(IDnum + 1) * row];
+            if (IDnum >= first_leaf) {
+                uint16_t* entries = &leaves[(size_t)(IDnum - first_leaf + 1) * row];
+                for (int card = 0; card < row; card++) {
+                    entries[card] = (uint16_t)children[card];
+                }
+                continue;
+            }
+
+            uint8_t* entries = &interior[(size_t)(IDnum + 1) * row * 3];
+            store24(&entries[0], children[0]);
+            for (int card = 1; card < row; card++) {
+                int p = children[card];
+                if (p) {
+                    // the next node, or its leaf row after 5 cards
+                    p = p / row - 1;
+                    p = p >= first_leaf ? p - first_leaf + 1 : p + 1;
+                }
+                store24(&entries[card * 3], p);
+            }
+        }
+    });
+
+    _PDEBUG("Compact table: %zu bytes, %d interior and %d leaf rows", table_size, header.interior_rows, header.leaf_rows);
+
+    write_table_header(reinterpret_cast<uint8_t*>(writer.data()), TableFormat::COMPACT, JOKER_DECK_SIZE, table_size, level_start);
+    writer.publish();
+}
+
+// Inserts suffix before the extension of the file name.
+static std::string suffixed_file_name(const std::string& file_name, const std::string& suffix) {
+    size_t dot = file_name.rfind('.');
+    if (dot == std::string::npos || (file_name.rfind('/') != std::string::npos && dot < file_name.rfind('/'))) {
+        return file_name + suffix;
+    }
+    return file_name.substr(0, dot) + suffix + file_name.substr(dot);
+}
+
+std::string truncated_file_name(const std::string& file_name, int max_cards) {
+    return suffixed_file_name(file_name, std::to_string(max_cards));
+}
+
+std::string flat5_file_name(const std::string& file_name) {
+    return suffixed_file_name(file_name, "_flat5");
+}
+
+std::string rank_hash_file_name(const std::string& file_name) {
+    return suffixed_file_name(file_name, "_hash");
+}
+
+void generate_truncated(const std::string& file_name, const int* ranks, size_t size, int deck_size, int max_cards) {
+    const int   row    = deck_size + 1;
+    TableFormat format = truncated_format(max_cards);
+
+    // the nodes of fewer than max_cards cards, the last of them become the leaves
+    std::vector<int> levels = table_levels(ranks, deck_size, (int)(size / sizeof(int) / row) - 1);
+    int              rows   = levels[max_cards];
+    std::fill(levels.begin() + max_cards, levels.end(), rows);
+
+    size_t      table_size = sizeof(int) * (size_t)(rows + 1) * row;
+    TableWriter writer(file_name, sizeof(TableHeader) + table_size);
+    int*        HR = reinterpret_cast<int*>(writer.data() + sizeof(TableHeader));
+    memcpy(HR, ranks, table_size);
+
+    tbb::parallel_for(tbb::blocked_range<int>(levels[max_cards - 1], rows), [&](const tbb::blocked_range<int>& range) {
+        for (int IDnum = range.begin(); IDnum != range.end(); IDnum++) {
+            int* children = &HR[(IDnum + 1) * row];
+            for (int card = 1; card < row; card++) {
+                if (children[card]) {
+                    children[card] = ranks[children[card]]; // rank of the max_cards node
+                }
+            }
+        }
+    });
+
+    int kept   = minimize_table(HR, deck_size, levels, max_cards - 1);
+    table_size = sizeof(int) * (size_t)(kept + 1) * row;
+    levels     = table_levels(HR, deck_size, kept, max_cards - 1);
+    _PDEBUG("Truncated table after %d cards: %d rows, %zu bytes", max_cards, kept, table_size);
+
+    write_table_header(reinterpret_cast<uint8_t*>(writer.data()), format, deck_size, table_size, levels);
+    writer.publish(sizeof(TableHeader) + table_size);
+}
+
+void generate_flat5(const std::string& file_name, const int* ranks, int deck_size) {
+    // 2 spare entries for the 32 bit gathers of flat5_lookup_batch()
+    size_t      table_size = sizeof(uint16_t) * ((size_t)flat5_size(deck_size) + 2);
+    TableWriter writer(file_name, sizeof(TableHeader) + table_size);
+    uint16_t*   table = reinterpret_cast<uint16_t*>(writer.data() + sizeof(TableHeader));
+
+    tbb::parallel_for(tbb::blocked_range<int>(1, deck_size + 1), [&](const tbb::blocked_range<int>& range) {
+        int c[5];
+        for (c[4] = range.begin(); c[4] != range.end(); c[4]++)
+        for (c[3] = 1; c[3] < c[4]; c[3]++)
+        for (c[2] = 1; c[2] < c[3]; c[2]++)
+        for (c[1] = 1; c[1] < c[2]; c[1]++)
+        for (c[0] = 1; c[0] < c[1]; c[0]++) {
+            int rank = table_lookup(ranks, deck_size, c, 5);
+            if (rank < 0 || rank > UINT16_MAX) {
+                throw Error("Hand rank " + std::to_string(rank) + " doesn't fit a flat table");
+            }
+            table[flat5_index(c)] = (uint16_t)rank;
+        }
+    });
+
+    _PDEBUG("Flat 5 card table: %d hands, %zu bytes", flat5_size(deck_size), table_size);
+
+    write_table_header(reinterpret_cast<uint8_t*>(writer.data()), TableFormat::FLAT5, deck_size, table_size, std::vector<int>(8, 0));
+    writer.publish();
+}
+
+static uint16_t rank_hash_entry(const int* ranks, const int* cards, int size) {
+    int rank = table_lookup(ranks, JOKER_DECK_SIZE, cards, size);
+    if (rank < 0 || rank > UINT16_MAX) {
+        throw Error("Hand rank " + std::to_string(rank) + " doesn't fit a rank hash table");
+    }
+    return (uint16_t)rank;
+}
+
+// Fills the entries of all multisets of size ranks, in ascending order from first on.
+static void fill_rank_hash(RankHashTable* table, const int* ranks, int* multiset, int count, int first, int size) {
+    if (count < size) {
+        for (int rank = first; rank < JOKER_RANKS_COUNT; rank++) {
+            if (count < 4 || multiset[count - 4] != rank) { // at most 4 cards of a rank
+                multiset[count] = rank;
+                fill_rank_hash(table, ranks, multiset, count + 1, rank, size);
+            }
+        }
+        return;
+    }
+
+    // The cards of a rank go to different suits and the suits are dealt round robin,
+    // so no suit has more than 2 cards, or 1 with 3 jokers: no flush with the jokers
+    // either. 4 jokers always make five of a kind.
+    int cards[7];
+    for (int i = 0; i < size; i++) {
+        cards[i] = multiset[i] * SUITS_COUNT + i % SUITS_COUNT + 1;
+    }
+    table->ranks[rank_hash_index(multiset, size)] = rank_hash_entry(ranks, cards, size);
+}
+
+void generate_rank_hash(const std::string& file_name, const int* ranks) {
+    TableWriter    writer(file_name, sizeof(TableHeader) + sizeof(RankHashTable));
+    RankHashTable* table = reinterpret_cast<RankHashTable*>(writer.data() + sizeof(TableHeader));
+    memset(table, 0, sizeof(RankHashTable));
+
+    int multiset[7];
+    for (int size = 5; size < 8; size++) {
+        fill_rank_hash(table, ranks, multiset, 0, 0, size);
+    }
+
+    // The cards of one suit with the jokers: their best hand is a flush or no better
+    // than the best hand of the ranks, so rank_hash_lookup() takes the larger one.
+    for (int jokers = 0; jokers <= RANK_HASH_JOKERS; jokers++) {
+        for (int suited = 0; suited < 1 << RANKS_COUNT; suited++) {
+            int size = __builtin_popcount(suited) + jokers;
+            if (size < 5 || size > 7) {
+                continue;
+            }
+            int cards[7];
+            int card = 0;
+            for (int rank = 0; rank < RANKS_COUNT; rank++) {
+                if (suited & (1 << rank)) {
+                    cards[card++] = rank * SUITS_COUNT + 1;
+                }
+            }
+            for (int joker = 0; joker < jokers; joker++) {
+                cards[card++] = STANDARD_DECK_SIZE + joker + 1;
+            }
+            table->flush[jokers][suited] = rank_hash_entry(ranks, cards, size);
+        }
+    }
+
+    _PDEBUG("Rank hash table: %d rank multisets, %zu bytes", RANK_HASH_BINOMIALS.offsets[8], sizeof(RankHashTable));
+
+    write_table_header(reinterpret_cast<uint8_t*>(writer.data()), TableFormat::RANK_HASH, JOKER_DECK_SIZE, sizeof(RankHashTable), std::vector<int>(8, 0));
+    writer.publish();
+}
+
+// The compact table keeps ranks only, the interior nodes of shorter hands are its own.
+static inline void check_compact_size(int size) {
+    if (size < 5 || size > 7) {
+        throw Error("Compact table needs 5 to 7 cards: " + std::to_string(size));
+    }
+}
+
+// Rank of a hand of 5 to 7 cards whose first min(size, 6) cards led to p.
+static inline int compact_rank(const uint8_t* interior, const uint16_t* leaves, int p, const int* cards, int size) {
+    const int row = JOKER_DECK_SIZE + 1;
+    switch (size) {
+        case 5:
+            return load24(&interior[(size_t)p * row * 3]);
+        case 6:
+            return leaves[(size_t)p * row];
+        default:
+            return leaves[(size_t)p * row + cards[6]];
+    }
+}
+
+int compact_lookup(const void* table, const int* cards, int size) {
+    const int            row      = JOKER_DECK_SIZE + 1;
+    const CompactHeader* header   = reinterpret_cast<const CompactHeader*>(table);
+    const uint8_t*       interior = reinterpret_cast<const uint8_t*>(table) + sizeof(CompactHeader);
+    const uint16_t*      leaves   = reinterpret_cast<const uint16_t*>(reinterpret_cast<const uint8_t*>(table) + header->leaf_offset);
+    check_compact_size(size);
+
+    int p = 1;
+    int i = 0;
+    for (; i < size && i < 6; ++i) {
+        p = load24(&interior[(size_t)(p * row + cards[i]) * 3]);
+    }
+
+    return compact_rank(interior, leaves, p, cards, size);
+}
+
+// Number of hands walked together by the batched lookups, enough
+// independent loads to keep the memory system busy.
+const int LOOKUP_BATCH_WIDTH = 64;
+
+// Walks a group of hands one card at a time, so the loads of different hands
+// overlap instead of every hand waiting for its own 7 dependent misses.
+// The row needed for the next card is prefetched as soon as it is known.
+static void lookup_batch_scalar(const int* ranks, int root, const int* cards, int stride, int size, int max_cards, int* out, size_t n) {
+    int  p[LOOKUP_BATCH_WIDTH];
+    bool node_rank = (size == 5 || size == 6) && size < max_cards;
+
+    for (size_t first = 0; first < n; first += LOOKUP_BATCH_WIDTH) {
+        int        width = (int)std::min<size_t>(LOOKUP_BATCH_WIDTH, n - first);
+        const int* hands = cards + first * stride;
+
+        for (int h = 0; h < width; ++h) {
+            p[h] = root;
+        }
+
+        for (int i = 0; i < size; ++i) {
+            for (int h = 0; h < width; ++h) {
+                p[h] = ranks[p[h] + hands[h * stride + i]];
+                if (i + 1 < size)
+                    __builtin_prefetch(&ranks[p[h] + hands[h * stride + i + 1]]);
+                else if (node_rank)
+                    __builtin_prefetch(&ranks[p[h]]);
+            }
+        }
+
+        if (node_rank) {
+            for (int h = 0; h < width; ++h) {
+                p[h] = ranks[p[h]];
+            }
+        }
+
+        std::copy(p, p + width, out + first);
+    }
+}
+
+// lookup_batch_scalar() over the compact table.
+void compact_lookup_batch(const void* table, const int* cards, int stride, int size, int* out, size_t n) {
+    const int            row      = JOKER_DECK_SIZE + 1;
+    const CompactHeader* header   = reinterpret_cast<const CompactHeader*>(table);
+    const uint8_t*       interior = reinterpret_cast<const uint8_t*>(table) + sizeof(CompactHeader);
+    const uint16_t*      leaves   = reinterpret_cast<const uint16_t*>(reinterpret_cast<const uint8_t*>(table) + header->leaf_offset);
+    const int            walked   = std::min(size, 6);
+    check_compact_size(size);
+
+    int p[LOOKUP_BATCH_WIDTH];
+    for (size_t first = 0; first < n; first += LOOKUP_BATCH_WIDTH) {
+        int        width = (int)std::min<size_t>(LOOKUP_BATCH_WIDTH, n - first);
+        const int* hands = cards + first * stride;
+
+        for (int h = 0; h < width; ++h) {
+            p[h] = 1;
+        }
+
+        for (int i = 0; i < walked; ++i) {
+            for (int h = 0; h < width; ++h) {
+                p[h] = load24(&interior[(size_t)(p[h] * row + hands[h * stride + i]) * 3]);
+                if (i + 1 < walked)
+                    __builtin_prefetch(&interior[(size_t)(p[h] * row + hands[h * stride + i + 1]) * 3]);
+                else if (size == 5)
+                    __builtin_prefetch(&interior[(size_t)p[h] * row * 3]);
+                else if (size > 5)
+                    __builtin_prefetch(&leaves[(size_t)p[h] * row + (size == 7 ? hands[h * stride + 6] : 0)]);
+            }
+        }
+
+        for (int h = 0; h < width; ++h) {
+            out[first + h] = compact_rank(interior, leaves, p[h], hands + h * stride, size);
+        }
+    }
+}
+
+#if defined(__x86_64__)
+// The same walk with trie cursors held in vector registers, every card level is
+// two hardware gathers per vector: the cards of the hands, then p = ranks[p + card].
+// Several vectors are in flight to overlap the gathers. Hands which don't fill
+// a whole group go to the scalar version.
+const int LOOKUP_BATCH_VECTORS = 16;
+
+__attribute__((target("avx2")))
+static void lookup_batch_avx2(const int* ranks, int root, const int* cards, int stride, int size, int max_cards, int* out, size_t n) {
+    const int     lanes        = 8;
+    const bool    node_rank    = (size == 5 || size == 6) && size < max_cards;
+    const __m256i card_offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+
+    size_t first = 0;
+    for (; first + lanes * LOOKUP_BATCH_VECTORS <= n; first += lanes * LOOKUP_BATCH_VECTORS) {
+        __m256i p[LOOKUP_BATCH_VECTORS];
+        for (int v = 0; v < LOOKUP_BATCH_VECTORS; ++v) {
+            p[v] = _mm256_set1_epi32(root);
+        }
+
+        for (int i = 0; i < size; ++i) {
+            for (int v = 0; v < LOOKUP_BATCH_VECTORS; ++v) {
+                const int* column = cards + (first + v * lanes) * stride + i;
+                __m256i    card   = _mm256_i32gather_epi32(column, card_offsets, 4);
+                p[v] = _mm256_i32gather_epi32(ranks, _mm256_add_epi32(p[v], card), 4);
+            }
+        }
+
+        for (int v = 0; v < LOOKUP_BATCH_VECTORS; ++v) {
+            if (node_rank) {
+                p[v] = _mm256_i32gather_epi32(ranks, p[v], 4);
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + first + v * lanes), p[v]);
+        }
+    }
+
+    lookup_batch_scalar(ranks, root, cards + first * stride, stride, size, max_cards, out + first, n - first);
+}
+
+// All 16 lanes of a gather, merged into zeros: the source of the unmasked
+// _mm512_i32gather_epi32 is left undefined, which GCC warns about.
+__attribute__((target("avx512f")))
+static inline __m512i gather_avx512(__m512i index, const int* base) {
+    return _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), (__mmask16)0xFFFF, index, base, 4);
+}
+
+__attribute__((target("avx512f")))
+static void lookup_batch_avx512(const int* ranks, int root, const int* cards, int stride, int size, int max_cards, int* out, size_t n) {
+    const int     lanes        = 16;
+    const bool    node_rank    = (size == 5 || size == 6) && size < max_cards;
+    const __m512i card_offsets = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(stride));
+
+    size_t first = 0;
+    for (; first + lanes * LOOKUP_BATCH_VECTORS <= n; first += lanes * LOOKUP_BATCH_VECTORS) {
+        __m512i p[LOOKUP_BATCH_VECTORS];
+        for (int v = 0; v < LOOKUP_BATCH_VECTORS; ++v) {
+            p[v] = _mm512_set1_epi32(root);
+        }
+
+        for (int i = 0; i < size; ++i) {
+            for (int v = 0; v < LOOKUP_BATCH_VECTORS; ++v) {
+                const int* column = cards + (first + v * lanes) * stride + i;
+                __m512i    card   = gather_avx512(card_offsets, column);
+                p[v] = gather_avx512(_mm512_add_epi32(p[v], card), ranks);
+            }
+        }
+
+        for (int v = 0; v < LOOKUP_BATCH_VECTORS; ++v) {
+            if (node_rank) {
+                p[v] = gather_avx512(p[v], ranks);
+            }
+            _mm512_storeu_si512(out + first + v * lanes, p[v]);
+        }
+    }
+
+    lookup_batch_scalar(ranks, root, cards + first * stride, stride, size, max_cards, out + first, n - first);
+}
+#endif
+
+typedef void (*LookupBatch)(const int* ranks, int root, const int* cards, int stride, int size, int max_cards, int* out, size_t n);
+typedef void (*LookupBatchFlat5)(const uint16_t* table, const int* cards, int stride, int* out, size_t n);
+
+struct LookupBatchKernel {
+    LookupBatch run;
+    const char* name;
+};
+
+// Picks the widest kernel the CPU supports, once.
+static const LookupBatchKernel& lookup_batch_kernel_select() {
+    static const LookupBatchKernel kernel = [] {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return LookupBatchKernel{lookup_batch_avx512, "avx512"};
+        if (__builtin_cpu_supports("avx2"))
+            return LookupBatchKernel{lookup_batch_avx2, "avx2"};
+#endif
+        return LookupBatchKernel{lookup_batch_scalar, "scalar"};
+    }();
+    return kernel;
+}
+
+const char* lookup_batch_kernel() {
+    return lookup_batch_kernel_select().name;
+}
+
+void Evaluator::standard_lookup_batch(const int* cards, int stride, int size, int* out, size_t n) {
+    if (size == 5 && options_.flat5)
+        flat5_lookup_batch(flat5_standard_table(), cards, stride, out, n);
+    else if (size >= 5 && options_.rank_hash)
+        rank_hash_lookup_batch(rank_hash_table(), cards, stride, size, out, n);
+    else if (options_.max_cards < 7 && size <= options_.max_cards)
+        lookup_batch_kernel_select().run(truncated_standard_table(), STANDARD_DECK_SIZE + 1, cards, stride, size, options_.max_cards, out, n);
+    else
+        lookup_batch_kernel_select().run(standard_table(), STANDARD_DECK_SIZE + 1, cards, stride, size, 7, out, n);
+}
+
+void Evaluator::lookup_batch(const int* cards, int stride, int size, int* out, size_t n) {
+    if (size == 5 && options_.flat5)
+        flat5_lookup_batch(flat5_table(), cards, stride, out, n);
+    else if (size >= 5 && options_.rank_hash)
+        rank_hash_lookup_batch(rank_hash_table(), cards, stride, size, out, n);
+    else if (options_.max_cards < 7 && size <= options_.max_cards)
+        lookup_batch_kernel_select().run(truncated_table(), JOKER_DECK_SIZE + 1, cards, stride, size, options_.max_cards, out, n);
+    else if (options_.compact)
+        compact_lookup_batch(compact_table(), cards, stride, size, out, n);
+    else
+        lookup_batch_kernel_select().run(table(), JOKER_DECK_SIZE + 1, cards, stride, size, 7, out, n);
+}
+
+static void flat5_lookup_batch_scalar(const uint16_t* table, const int* cards, int stride, int* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = flat5_lookup(table, cards + i * stride);
+    }
+}
+
+#if defined(__x86_64__)
+// flat5_index() of 8 hands in the lanes of vectors: the number of smaller cards
+// from 10 compares, then a gather of the binomials of every card and one of the ranks.
+// Lanes with a repeated card skip the last gather and get 0.
+__attribute__((target("avx2")))
+static void flat5_lookup_batch_avx2(const uint16_t* table, const int* cards, int stride, int* out, size_t n) {
+    const int     lanes        = 8;
+    const __m256i card_offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+    const __m256i row          = _mm256_set1_epi32(JOKER_DECK_SIZE + 2);
+    const __m256i low16        = _mm256_set1_epi32(0xFFFF);
+    const int*    binomials    = &FLAT5_BINOMIALS.values[0][0];
+
+    size_t first = 0;
+    for (; first + lanes <= n; first += lanes) {
+        __m256i c[5];
+        __m256i smaller[5];
+        __m256i repeated = _mm256_setzero_si256();
+        for (int i = 0; i < 5; ++i) {
+            c[i]       = _mm256_i32gather_epi32(cards + first * stride + i, card_offsets, 4);
+            smaller[i] = _mm256_setzero_si256();
+        }
+        for (int i = 0; i < 5; ++i) {
+            for (int j = i + 1; j < 5; ++j) {
+                __m256i greater = _mm256_cmpgt_epi32(c[i], c[j]); // -1 where c[j] < c[i]
+                smaller[i] = _mm256_sub_epi32(smaller[i], greater);
+                smaller[j] = _mm256_sub_epi32(smaller[j], _mm256_xor_si256(greater, _mm256_set1_epi32(-1)));
+                repeated   = _mm256_or_si256(repeated, _mm256_cmpeq_epi32(c[i], c[j]));
+            }
+        }
+
+        __m256i index = _mm256_setzero_si256();
+        for (int i = 0; i < 5; ++i) {
+            __m256i entry = _mm256_add_epi32(_mm256_mullo_epi32(smaller[i], row), c[i]);
+            index = _mm256_add_epi32(index, _mm256_i32gather_epi32(binomials, entry, 4));
+        }
+        __m256i valid = _mm256_xor_si256(repeated, _mm256_set1_epi32(-1));
+        __m256i rank  = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), reinterpret_cast<const int*>(table), index, valid, 2);
+        rank = _mm256_and_si256(rank, low16);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + first), rank);
+    }
+
+    flat5_lookup_batch_scalar(table, cards + first * stride, stride, out + first, n - first);
+}
+#endif
+
+void flat5_lookup_batch(const uint16_t* table, const int* cards, int stride, int* out, size_t n) {
+    static const LookupBatchFlat5 kernel = [] {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return flat5_lookup_batch_avx2;
+#endif
+        return flat5_lookup_batch_scalar;
+    }();
+    kernel(table, cards, stride, out, n);
+}
+
+void rank_hash_lookup_batch(const RankHashTable* table, const int* cards, int stride, int size, int* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = rank_hash_lookup(table, cards + i * stride, size);
+    }
+}
+
+void standard_lookup_batch(const int* cards, int stride, int size, int* out, size_t n) {
+    default_evaluator().standard_lookup_batch(cards, stride, size, out, n);
+}
+
+void lookup_batch(const int* cards, int stride, int size, int* out, size_t n) {
+    default_evaluator().lookup_batch(cards, stride, size, out, n);
+}
+
+// Cards are 1..56, so a set of cards fits in one 64 bit word.
+static inline uint64_t card_bit(int card) {
+    return (uint64_t)1 << card;
+}
+
+static inline uint64_t hand_bits(const HoleCards& hand) {
+    return card_bit(hand[0]) | card_bit(hand[1]);
+}
+
+// Random deals made with one generator. Blocks have a fixed size and are seeded
+// by their number, so the result doesn't depend on how they are split between threads.
+const size_t EQUITY_BLOCK_TRIALS = 4096;
+
+// True if the ranges from the player on have hands which don't share a card
+// with each other and with the dealt cards. Ranges of one hand are already dealt.
+static bool can_deal_ranges(const std::vector<Range>& ranges, size_t player, uint64_t dealt) {
+    while (player < ranges.size() && ranges[player].size() < 2) {
+        player++;
+    }
+    if (player == ranges.size()) {
+        return true;
+    }
+    for (const HoleCards& hand : ranges[player]) {
+        if (!(hand_bits(hand) & dealt) && can_deal_ranges(ranges, player + 1, dealt | hand_bits(hand))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<Equity> monte_carlo_equity(const std::vector<Range>& players,
+                                       const std::vector<int>& board,
+                                       const std::vector<int>& dead,
+                                       const EquityOptions& options) {
+    const int numplayers = (int)players.size();
+    const int deck_size  = options.deck_size;
+
+    if (deck_size != STANDARD_DECK_SIZE && deck_size != JOKER_DECK_SIZE) {
+        throw Error("Bad deck size: " + std::to_string(deck_size));
+    }
+    if (numplayers < 2) {
+        throw Error("Need at least 2 players");
+    }
+    if (options.trials == 0) {
+        throw Error("Need at least 1 trial");
+    }
+    if (board.size() > 5) {
+        throw Error("Too many board cards: " + std::to_string(board.size()));
+    }
+
+    uint64_t used = 0;
+    auto use_card = [&](int card) {
+        if (card < 1 || card > deck_size) {
+            throw Error("Bad card: " + std::to_string(card));
+        }
+        if (used & card_bit(card)) {
+            throw Error("Duplicated card: " + cards_to_str(&card, 1));
+        }
+        used |= card_bit(card);
+    };
+
+    for (int card : board) {
+        use_card(card);
+    }
+    for (int card : dead) {
+        use_card(card);
+    }
+
+    // known hands take their cards out of the deck, ranges lose the hands which can't be dealt
+    std::vector<Range> ranges(players);
+    for (int player = 0; player < numplayers; player++) {
+        if (ranges[player].size() == 1) {
+            use_card(ranges[player][0][0]);
+            use_card(ranges[player][0][1]);
+        }
+    }
+    for (int player = 0; player < numplayers; player++) {
+        Range& range = ranges[player];
+        if (range.size() < 2) {
+            continue;
+        }
+        for (const HoleCards& hand : range) {
+            if (hand[0] < 1 || hand[0] > deck_size || hand[1] < 1 || hand[1] > deck_size || hand[0] == hand[1]) {
+                throw Error("Bad hand in the range of player " + std::to_string(player) + ": " + cards_to_str(hand.data(), 2));
+            }
+        }
+        range.erase(std::remove_if(range.begin(), range.end(), [&](const HoleCards& hand) { return hand_bits(hand) & used; }), range.end());
+        if (range.empty()) {
+            throw Error("No hand in the range of player " + std::to_string(player) + " can be dealt");
+        }
+    }
+
+    // the ranges are dealt together and redrawn on a conflict, which never ends without a valid deal
+    if (!can_deal_ranges(ranges, 0, used)) {
+        throw Error("The ranges of the players can't be dealt together");
+    }
+
+    std::vector<int> deck;
+    for (int card = 1; card < deck_size + 1; card++) {
+        if (!(used & card_bit(card))) {
+            deck.push_back(card);
+        }
+    }
+    const int board_left = 5 - (int)board.size();
+    if ((int)deck.size() < board_left + 2 * numplayers) {
+        throw Error("Not enough cards in the deck");
+    }
+
+    // the known part of the board is walked once for all deals
+    HandCursor board_cursor;
+    for (int card : board) {
+        board_cursor.push(card);
+    }
+
+    const size_t blocks = (options.trials + EQUITY_BLOCK_TRIALS - 1) / EQUITY_BLOCK_TRIALS;
+    std::vector<std::vector<double>> block_results(blocks);
+
+    tbb::task_arena arena(options.threads > 0 ? options.threads : tbb::task_arena::automatic);
+    arena.execute([&] {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, blocks), [&](const tbb::blocked_range<size_t>& range) {
+            std::vector<HoleCards> hands(numplayers);
+            std::vector<int>       hand_ranks(numplayers);
+
+            for (size_t block = range.begin(); block != range.end(); block++) {
+                std::seed_seq   seed{(uint32_t)options.seed, (uint32_t)(options.seed >> 32), (uint32_t)block, (uint32_t)(block >> 32)};
+                std::mt19937_64 rng(seed);
+
+                // win, tie and equity for every player
+                std::vector<double> result(3 * numplayers);
+
+                size_t first = block * EQUITY_BLOCK_TRIALS;
+                size_t last  = std::min(options.trials, first + EQUITY_BLOCK_TRIALS);
+                for (size_t trial = first; trial < last; trial++) {
+                    // every range is drawn at once and the whole draw is repeated if two hands
+                    // share a card, so each valid combination of hands is equally likely
+                    uint64_t dealt;
+                    bool     conflict;
+                    do {
+                        dealt    = used;
+                        conflict = false;
+                        for (int player = 0; player < numplayers && !conflict; player++) {
+                            const Range& range = ranges[player];
+                            if (range.size() == 1) {
+                                hands[player] = range[0];
+                            }
+                            else if (range.size() > 1) {
+                                hands[player] = range[rng() % range.size()];
+                                conflict      = (hand_bits(hands[player]) & dealt) != 0;
+                                dealt        |= hand_bits(hands[player]);
+                            }
+                        }
+                    } while (conflict);
+
+                    auto deal_card = [&]() {
+                        int card;
+                        do {
+                            card = deck[rng() % deck.size()];
+                        } while (dealt & card_bit(card));
+                        dealt |= card_bit(card);
+                        return card;
+                    };
+
+                    for (int player = 0; player < numplayers; player++) {
+                        if (ranges[player].empty()) {
+                            hands[player][0] = deal_card();
+                            hands[player][1] = deal_card();
+                        }
+                    }
+
+                    HandCursor cursor = board_cursor;
+                    for (int i = 0; i < board_left; i++) {
+                        cursor.push(deal_card());
+                    }
+
+                    int best    = 0;
+                    int winners = 0;
+                    for (int player = 0; player < numplayers; player++) {
+                        HandCursor hand = cursor;
+                        hand.push(hands[player][0]);
+                        hand.push(hands[player][1]);
+                        hand_ranks[player] = hand.rank();
+                        if (hand_ranks[player] > best) {
+                            best    = hand_ranks[player];
+                            winners = 1;
+                        }
+                        else if (hand_ranks[player] == best) {
+                            winners++;
+                        }
+                    }
+
+                    for (int player = 0; player < numplayers; player++) {
+                        if (hand_ranks[player] == best) {
+                            result[3 * player + (winners == 1 ? 0 : 1)] += 1;
+                            result[3 * player + 2] += 1.0 / winners;
+                        }
+                    }
+                }
+
+                block_results[block] = std::move(result);
+            }
+        });
+    });
+
+    std::vector<Equity> equities(numplayers);
+    for (const std::vector<double>& result : block_results) {
+        for (int player = 0; player < numplayers; player++) {
+            equities[player].win += result[3 * player];
+            equities[player].tie += result[3 * player + 1];
+            equities[player].equity += result[3 * player + 2];
+        }
+    }
+    for (Equity& equity : equities) {
+        equity.win /= options.trials;
+        equity.tie /= options.trials;
+        equity.equity /= options.trials;
+    }
+    return equities;
+}
+
+// Set of cards shifted so that bit rank * 4 + suit is a card, 4 bits per rank.
+static inline uint64_t permute_suits(uint64_t cards, const std::array<int, SUITS_COUNT>& suits) {
+    const uint64_t first_suit = 0x1111111111111111ull;
+    uint64_t       result     = 0;
+    for (int suit = 0; suit < SUITS_COUNT; suit++) {
+        result |= ((cards >> suit) & first_suit) << suits[suit];
+    }
+    return result;
+}
+
+// Enumerates the boards starting with one card in nested order, like the
+// enumeration loops do: every player's cursor gets one card per level, so the
+// shared prefixes are walked once. Only the smallest board of every suit
+// isomorphism class is evaluated, weighted by the size of the class.
+class RunoutEnumerator {
+public:
+    RunoutEnumerator(const std::vector<int>& deck, const std::vector<HandCursor>& hands, const std::vector<std::array<int, SUITS_COUNT>>& symmetries, int board_left)
+        : deck_(deck)
+        , hands_(hands)
+        , symmetries_(symmetries)
+        , board_left_(board_left)
+        , ranks_(hands.size())
+        , result_(3 * hands.size())
+    {}
+
+    void run(int first) {
+        deal(1, first);
+    }
+
+    // win, tie and equity for every player, weighted by the number of boards
+    std::vector<double>& result() { return result_; }
+
+private:
+    void deal(int level, int index) {
+        int card = deck_[index];
+        board_ |= card_bit(card) >> 1;
+
+        if (level == board_left_) {
+            evaluate(card);
+        }
+        else {
+            for (HandCursor& hand : hands_) {
+                hand.push(card);
+            }
+            for (int next = index + 1; next < (int)deck_.size() - (board_left_ - level - 1); next++) {
+                deal(level + 1, next);
+            }
+            for (HandCursor& hand : hands_) {
+                hand.pop();
+            }
+        }
+
+        board_ &= ~(card_bit(card) >> 1);
+    }
+
+    void evaluate(int card) {
+        int same = 0;
+        for (const std::array<int, SUITS_COUNT>& suits : symmetries_) {
+            uint64_t image = permute_suits(board_, suits);
+            if (image < board_) {
+                return; // not the smallest board of its class
+            }
+            same += image == board_;
+        }
+        double weight = (double)symmetries_.size() / same;
+
+        int best    = 0;
+        int winners = 0;
+        for (size_t player = 0; player < hands_.size(); player++) {
+            HandCursor& hand = hands_[player];
+            hand.push(card);
+            ranks_[player] = hand.rank();
+            hand.pop();
+            if (ranks_[player] > best) {
+                best    = ranks_[player];
+                winners = 1;
+            }
+            else if (ranks_[player] == best) {
+                winners++;
+            }
+        }
+
+        for (size_t player = 0; player < hands_.size(); player++) {
+            if (ranks_[player] == best) {
+                result_[3 * player + (winners == 1 ? 0 : 1)] += weight;
+                result_[3 * player + 2] += weight / winners;
+            }
+        }
+    }
+
+    const std::vector<int>&                              deck_;
+    std::vector<HandCursor>                              hands_;
+    const std::vector<std::array<int, SUITS_COUNT>>&     symmetries_;
+    int                                                  board_left_;
+    std::vector<int>                                     ranks_;
+    std::vector<double>                                  result_;
+    uint64_t                                             board_ = 0;
+};
+
+std::vector<Equity> exact_equity(const std::vector<HoleCards>& players,
+                                 const std::vector<int>& board,
+                                 const std::vector<int>& dead,
+                                 const EquityOptions& options) {
+    const int numplayers = (int)players.size();
+    const int deck_size  = options.deck_size;
+
+    if (deck_size != STANDARD_DECK_SIZE && deck_size != JOKER_DECK_SIZE) {
+        throw Error("Bad deck size: " + std::to_string(deck_size));
+    }
+    if (numplayers < 2) {
+        throw Error("Need at least 2 players");
+    }
+    if (board.size() > 5) {
+        throw Error("Too many board cards: " + std::to_string(board.size()));
+    }
+
+    uint64_t used = 0;
+    auto use_card = [&](int card) {
+        if (card < 1 || card > deck_size) {
+            throw Error("Bad card: " + std::to_string(card));
+        }
+        if (used & card_bit(card)) {
+            throw Error("Duplicated card: " + cards_to_str(&card, 1));
+        }
+        used |= card_bit(card);
+    };
+
+    std::vector<uint64_t> known;
+    auto add_known = [&](const int* cards, size_t size) {
+        uint64_t mask = 0;
+        for (size_t i = 0; i < size; i++) {
+            use_card(cards[i]);
+            mask |= card_bit(cards[i]) >> 1;
+        }
+        known.push_back(mask);
+    };
+    for (const HoleCards& hand : players) {
+        add_known(hand.data(), hand.size());
+    }
+    add_known(board.data(), board.size());
+    add_known(dead.data(), dead.size());
+
+    // suit permutations which keep every hand, the board and the dead cards the same
+    std::vector<std::array<int, SUITS_COUNT>> symmetries;
+    std::array<int, SUITS_COUNT> suits = {0, 1, 2, 3};
+    do {
+        if (std::all_of(known.begin(), known.end(), [&](uint64_t mask) { return permute_suits(mask, suits) == mask; })) {
+            symmetries.push_back(suits);
+        }
+    } while (std::next_permutation(suits.begin(), suits.end()));
+
+    std::vector<int> deck;
+    for (int card = 1; card < deck_size + 1; card++) {
+        if (!(used & card_bit(card))) {
+            deck.push_back(card);
+        }
+    }
+
+    std::vector<HandCursor> hands(numplayers);
+    for (int player = 0; player < numplayers; player++) {
+        hands[player].push(players[player][0]);
+        hands[player].push(players[player][1]);
+        for (int card : board) {
+            hands[player].push(card);
+        }
+    }
+
+    const int board_left = 5 - (int)board.size();
+    if ((int)deck.size() < board_left) {
+        throw Error("Not enough cards in the deck");
+    }
+
+    // win, tie and equity for every player, per first card of the board
+    std::vector<std::vector<double>> first_results;
+
+    if (board_left == 0) {
+        // nothing to deal, evaluate the only board
+        std::vector<double> result(3 * numplayers);
+        int best = 0, winners = 0;
+        for (HandCursor& hand : hands) {
+            if (hand.rank() > best) {
+                best    = hand.rank();
+                winners = 1;
+            }
+            else if (hand.rank() == best) {
+                winners++;
+            }
+        }
+        for (int player = 0; player < numplayers; player++) {
+            if (hands[player].rank() == best) {
+                result[3 * player + (winners == 1 ? 0 : 1)] = 1;
+                result[3 * player + 2] = 1.0 / winners;
+            }
+        }
+        first_results.push_back(result);
+    }
+    else {
+        // one task per first board card, summed in order so the result doesn't depend on threads
+        first_results.resize(deck.size() - board_left + 1);
+
+        tbb::task_arena arena(options.threads > 0 ? options.threads : tbb::task_arena::automatic);
+        arena.execute([&] {
+            tbb::parallel_for(0, (int)first_results.size(), [&](int first) {
+                RunoutEnumerator enumerator(deck, hands, symmetries, board_left);
+                enumerator.run(first);
+                first_results[first] = std::move(enumerator.result());
+            });
+        });
+    }
+
+    std::vector<Equity> equities(numplayers);
+    for (const std::vector<double>& result : first_results) {
+        for (int player = 0; player < numplayers; player++) {
+            equities[player].win += result[3 * player];
+            equities[player].tie += result[3 * player + 1];
+            equities[player].equity += result[3 * player + 2];
+        }
+    }
+
+    // C(deck, board_left) boards in total
+    double boards = 1;
+    for (int i = 0; i < board_left; i++) {
+        boards = boards * (deck.size() - i) / (i + 1);
+    }
+
+    for (Equity& equity : equities) {
+        equity.win /= boards;
+        equity.tie /= boards;
+        equity.equity /= boards;
+    }
+    return equities;
 }
 
 } // namespace pokerlib
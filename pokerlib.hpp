@@ -7,6 +7,10 @@
 #include <cassert>
 #include <exception>
 #include <climits>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <future>
 
 #include <iostream>
 
@@ -19,12 +23,11 @@
 
 namespace pokerlib {
 
-const char* RANKS_FILE_NAME = "handranks.dat";
-const char* STANDARD_RANKS_FILE_NAME = "standard_handranks.dat";
-
-static mio::mmap_source ranks_map __attribute__((init_priority(101)));
-static mio::mmap_source standard_ranks_map __attribute__((init_priority(101)));
+const char* const RANKS_FILE_NAME = "handranks.dat";
+const char* const STANDARD_RANKS_FILE_NAME = "standard_handranks.dat";
+const char* const COMPACT_RANKS_FILE_NAME = "handranks16.dat";
 
+// Joker table of the default evaluator.
 const int* get_table();
 
 // Not optimized combinations for 7 cards: 52!/(7!*(52-7)!) = 133,784,560
@@ -49,6 +52,35 @@ const int RANKS_COUNT = 13;
 const int JOKER_RANKS_COUNT = 14;
 const int SUITS_COUNT = 4;
 
+const uint32_t TABLE_MAGIC         = 0x54524B50; // "PKRT"
+const uint32_t TABLE_VERSION       = 1;
+const size_t   TABLE_SAMPLE_STRIDE = 64;         // sampled checksum reads the first page of every 64
+
+enum class TableFormat : uint32_t {
+    FULL       = 1, // int entries, see lookup()
+    COMPACT    = 2, // see generate_compact()
+    FIVE_CARDS = 3, // FULL up to 5 or 6 cards, see generate_truncated()
+    SIX_CARDS  = 4,
+    FLAT5      = 5, // 16 bit ranks of the 5 card hands by colex index, see generate_flat5()
+    RANK_HASH  = 6  // RankHashTable, see generate_rank_hash()
+};
+
+// Every table file starts with this header, the table itself follows at sizeof(TableHeader).
+// Loading checks the header only, the checksums are verified on request (see Verify).
+struct TableHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t format;           // TableFormat
+    uint32_t deck_size;
+    uint64_t size;             // bytes of the table after the header
+    uint64_t checksum;         // of the whole table
+    uint64_t sampled_checksum; // of the first 4 KiB of every TABLE_SAMPLE_STRIDE pages
+    int32_t  levels[8];        // first node of every card count, levels[7] - number of nodes
+    uint8_t  reserved[56];
+};
+
+static_assert(sizeof(TableHeader) == 128, "table data should stay cache line aligned");
+
 enum Hand {
     HIGH_CARD       = 1,
     ONE_PAIR        = 2,
@@ -76,7 +108,7 @@ inline const char* to_string(Hand h)
 	case FOUR_OF_A_KIND : return "FourOfAKind";
 	case STRAIGHT_FLUSH : return "StraightFlush";
 	case FIVE_OF_A_KIND : return "FiveOfAKind";
-	default             : return "Unknown";
+        default             : return "Unknown";
     }
 }
 
@@ -240,7 +272,7 @@ inline int convert_kev_rank(int holdrank) {
     return result;
 }
 
-uint64_t pack_to_id(int* c) {
+inline uint64_t pack_to_id(int* c) {
     return (uint64_t)c[0]
         + ((uint64_t)c[1] << 8)
         + ((uint64_t)c[2] << 16)
@@ -257,12 +289,42 @@ inline int operator"" _c(const char* card, size_t size) {
 
 template <std::size_t N> using Cards = int[N];
 
-void generate(const std::string& file_name);
-
-void init() __attribute__((constructor));
-void fini() __attribute__((destructor));
-//void init();
-//void fini();
+// Table generators, threads is the number of worker threads (0 - use all cores).
+// With relayout the rows are ordered as relayout() does for uniform deals.
+void generate_standard(const std::string& file_name, int threads = 0, bool relayout = false);
+// The joker table is derived from the standard one, which is generated if missing.
+void generate(const std::string& file_name, int threads = 0, const std::string& standard_file_name = STANDARD_RANKS_FILE_NAME,
+              bool relayout = false);
+// Rewrites the full table in_file to out_file with the rows of every level ordered
+// by how often lookups reach them, so the hot rows share cache lines and pages:
+// uniform deals, or the walks of the profile hands if there are any.
+void relayout(const std::string& in_file, const std::string& out_file, const std::vector<std::vector<int>>& profile = {});
+// Compact copy of the joker table: 16 bit leaf ranks and 24 bit interior node
+// indices, ~40% smaller. An evaluator with compact option maps it instead of
+// the full table for lookup().
+void generate_compact(const std::string& file_name, const int* ranks, size_t size);
+// Copy of a full table cut after max_cards (5 or 6) cards: the last card leads
+// straight to the hand rank instead of a node holding it, so table_lookup()
+// with max_cards skips a load. An evaluator with max_cards maps it for lookups
+// of up to max_cards cards.
+void generate_truncated(const std::string& file_name, const int* ranks, size_t size, int deck_size, int max_cards);
+// "dir/handranks.dat" -> "dir/handranks5.dat"
+std::string truncated_file_name(const std::string& file_name, int max_cards);
+// Ranks of all 5 card hands of a full table by colex index (see flat5_index()),
+// 16 bit entries: ~7.6 MB for the joker deck, ~5.2 MB for the standard one.
+void generate_flat5(const std::string& file_name, const int* ranks, int deck_size);
+// "dir/handranks.dat" -> "dir/handranks_flat5.dat"
+std::string flat5_file_name(const std::string& file_name);
+// RankHashTable made from the full joker table, ~290 KB. It serves the standard
+// deck too, its hands have no jokers.
+void generate_rank_hash(const std::string& file_name, const int* ranks);
+// "dir/handranks.dat" -> "dir/handranks_hash.dat"
+std::string rank_hash_file_name(const std::string& file_name);
+
+// Loads the tables of the default evaluator now instead of on the first lookup.
+void init();
+// Unmaps the tables of the default evaluator.
+void fini();
 
 void        init_deck(int* deck);
 int         find_card(int rank, int suit, int* deck);
@@ -273,15 +335,617 @@ int         eval_5cards(int c1, int c2, int c3, int c4, int c5);
 int         eval_5hand(const int* hand);
 int         eval_6hand(const int* hand);
 int         eval_7hand(const int* hand);
-int         standard_lookup(const int* cards, int size);
-int         lookup(const int* cards, int size);
+
+enum class PageMode {
+    DEFAULT,          // 4 KiB pages of the mapped file
+    TRANSPARENT_HUGE, // anonymous copy with madvise(MADV_HUGEPAGE)
+    HUGETLB,          // anonymous copy with MAP_HUGETLB
+    HUGETLBFS         // the file itself is on hugetlbfs
+};
+
+inline const char* to_string(PageMode mode)
+{
+    switch (mode)
+    {
+        case PageMode::DEFAULT         : return "Default";
+        case PageMode::TRANSPARENT_HUGE: return "TransparentHuge";
+        case PageMode::HUGETLB         : return "HugeTLB";
+        case PageMode::HUGETLBFS       : return "HugeTLBFS";
+        default                        : return "Unknown";
+    }
+}
+
+
+enum class Verify {
+    NONE,
+    SAMPLED, // sampled checksum, ~1/64 of the table
+    FULL     // checksum of the whole table
+};
+
+enum class WarmUp {
+    NONE,
+    POPULATE, // madvise(MADV_POPULATE_READ), page tables filled in one call
+    WILLNEED, // madvise(MADV_WILLNEED), asynchronous readahead
+    MLOCK,    // mlock(), resident until fini(); needs RLIMIT_MEMLOCK
+    TOUCH     // parallel read of one int per page
+};
+
+inline const char* to_string(WarmUp mode)
+{
+    switch (mode)
+    {
+        case WarmUp::NONE    : return "None";
+        case WarmUp::POPULATE: return "Populate";
+        case WarmUp::WILLNEED: return "WillNeed";
+        case WarmUp::MLOCK   : return "MLock";
+        case WarmUp::TOUCH   : return "Touch";
+        default              : return "Unknown";
+    }
+}
+
+struct WarmUpStats {
+    WarmUp mode     = WarmUp::NONE; // mode which actually ran, POPULATE and MLOCK fall back to TOUCH
+    double seconds  = 0;
+    size_t pages    = 0;            // pages of the mapped tables
+    size_t resident = 0;            // pages in memory after the warm-up, by mincore()
+};
+
+// Rank of a hand of 5 to 7 cards in the compact table, throws Error for other sizes:
+// the nodes a shorter hand leads to are offsets of this table, not of the full one.
+int compact_lookup(const void* table, const int* cards, int size);
+// compact_lookup() of n hands, hand i starts at cards[i * stride].
+void compact_lookup_batch(const void* table, const int* cards, int stride, int size, int* out, size_t n);
+
+// Node (or rank, after 7 cards) reached by the first SIZE cards. A fixed count,
+// so inlined into callers the compiler sees the bound of the walk.
+template <int SIZE>
+inline int table_walk(const int* ranks, int deck_size, const int* cards) {
+    int p = deck_size + 1;
+    for (int i = 0; i < SIZE; ++i) {
+        p = ranks[p + cards[i]];
+    }
+    return p;
+}
+
+// Lookup of a poker hand in a full table, cards should be a pointer to an array
+// of integers each with value between 1 and deck_size inclusive. Inline so that
+// loops over hands with a constant size get unrolled and interleaved.
+inline int table_lookup(const int* ranks, int deck_size, const int* cards, int size, int max_cards = 7) {
+    switch (size) {
+        case 1:
+            return table_walk<1>(ranks, deck_size, cards);
+        case 2:
+            return table_walk<2>(ranks, deck_size, cards);
+        case 3:
+            return table_walk<3>(ranks, deck_size, cards);
+        case 4:
+            return table_walk<4>(ranks, deck_size, cards);
+        case 5: {
+            int p = table_walk<5>(ranks, deck_size, cards);
+            return max_cards > 5 ? ranks[p] : p;
+        }
+        case 6: {
+            int p = table_walk<6>(ranks, deck_size, cards);
+            return max_cards > 6 ? ranks[p] : p;
+        }
+        case 7:
+            return table_walk<7>(ranks, deck_size, cards);
+        default:
+            return deck_size + 1;
+    }
+}
+
+// FLAT5_BINOMIALS.values[r][card] = C(card - 1, r + 1). The colex index of a 5 card
+// hand is the sum of the values of its cards, r being the number of smaller cards
+// in the hand, so the cards don't have to be sorted.
+struct Flat5Binomials {
+    int values[5][JOKER_DECK_SIZE + 2];
+};
+
+constexpr Flat5Binomials make_flat5_binomials() {
+    Flat5Binomials binomials{};
+    for (int card = 1; card < JOKER_DECK_SIZE + 2; card++) {
+        int value = card - 1; // C(card - 1, 1)
+        for (int r = 0; r < 5; r++) {
+            binomials.values[r][card] = value;
+            value = value * (card - 2 - r) / (r + 2);
+        }
+    }
+    return binomials;
+}
+
+constexpr Flat5Binomials FLAT5_BINOMIALS = make_flat5_binomials();
+
+// Entries of a flat table for deck_size cards, C(deck_size, 5).
+inline int flat5_size(int deck_size) { return FLAT5_BINOMIALS.values[4][deck_size + 1]; }
+
+// Colex index of 5 cards in any order, branchless. -1 if a card is repeated.
+inline int flat5_index(const int* cards) {
+    int smaller[5] = {};
+    int repeated   = 0;
+    for (int i = 0; i < 5; ++i) {
+        for (int j = i + 1; j < 5; ++j) {
+            int less = cards[i] < cards[j];
+            smaller[j] += less;
+            smaller[i] += 1 - less;
+            repeated   |= cards[i] == cards[j];
+        }
+    }
+
+    int index = 0;
+    for (int i = 0; i < 5; ++i) {
+        index += FLAT5_BINOMIALS.values[smaller[i]][cards[i]];
+    }
+    return index | -repeated;
+}
+
+// Rank of 5 cards in a flat table, one load instead of the trie walk.
+// 0 if a card is repeated.
+inline int flat5_lookup(const uint16_t* table, const int* cards) {
+    int index = flat5_index(cards);
+    return index < 0 ? 0 : table[index];
+}
+
+// flat5_lookup() of n hands, hand i starts at cards[i * stride].
+void flat5_lookup_batch(const uint16_t* table, const int* cards, int stride, int* out, size_t n);
+
+// Rank hash backend: the best hand of 5 to 7 cards without a flush depends only on
+// the multiset of their ranks (the joker being the 14th rank), the flushes only on
+// the ranks of a suit and the number of jokers. So instead of the trie walk a hand
+// takes a lookup by the multiset index and, if a suit has enough cards for a flush,
+// one more by the ranks of that suit; both tables fit in L2.
+const int RANK_HASH_JOKERS = JOKER_DECK_SIZE - STANDARD_DECK_SIZE;
+
+// values[k][x] = C(x, k); offsets[size] - first index of the hands of size cards.
+struct RankHashBinomials {
+    int values[8][JOKER_RANKS_COUNT + 7];
+    int offsets[9];
+};
+
+constexpr RankHashBinomials make_rank_hash_binomials() {
+    RankHashBinomials binomials{};
+    for (int x = 0; x < JOKER_RANKS_COUNT + 7; x++) {
+        binomials.values[0][x] = 1;
+        for (int k = 1; k < 8; k++) {
+            binomials.values[k][x] = x ? binomials.values[k][x - 1] + binomials.values[k - 1][x - 1] : 0;
+        }
+    }
+    // multisets of size cards out of JOKER_RANKS_COUNT ranks: C(JOKER_RANKS_COUNT + size - 1, size)
+    for (int size = 5; size < 8; size++) {
+        binomials.offsets[size + 1] = binomials.offsets[size] + binomials.values[size][JOKER_RANKS_COUNT + size - 1];
+    }
+    return binomials;
+}
+
+constexpr RankHashBinomials RANK_HASH_BINOMIALS = make_rank_hash_binomials();
+
+struct RankHashTable {
+    uint16_t flush[RANK_HASH_JOKERS + 1][1 << RANKS_COUNT]; // best hand of the cards of a suit and the jokers
+    uint16_t ranks[RANK_HASH_BINOMIALS.offsets[8]];          // best hand by rank_hash_index()
+};
+
+// Index of a multiset of 5 to 7 ranks (0..13) in any order: the colex index of the
+// sorted ranks r0 <= r1 <= ... made strictly increasing by adding their positions.
+inline int rank_hash_index(const int* ranks, int size) {
+    int position[7] = {};
+    for (int i = 0; i < size; ++i) {
+        for (int j = i + 1; j < size; ++j) {
+            int less = ranks[j] < ranks[i];
+            position[i] += less;
+            position[j] += 1 - less;
+        }
+    }
+
+    int index = RANK_HASH_BINOMIALS.offsets[size];
+    for (int i = 0; i < size; ++i) {
+        index += RANK_HASH_BINOMIALS.values[position[i] + 1][ranks[i] + position[i]];
+    }
+    return index;
+}
+
+// The same result as lookup() of 5 to 7 distinct cards, jokers included.
+// 0 if a card is repeated.
+inline int rank_hash_lookup(const RankHashTable* table, const int* cards, int size) {
+    const uint64_t joker_bits = 0x2000200020002000ull; // rank 13 in every suit
+
+    int      ranks[7];
+    uint64_t suits = 0; // 16 rank bits per suit, one bit per card
+    for (int i = 0; i < size; ++i) {
+        int card = cards[i] - 1;
+        ranks[i] = card >> 2;
+        suits |= (uint64_t)1 << ((card & 3) * 16 + ranks[i]);
+    }
+    if (__builtin_popcountll(suits) != size) {
+        return 0;
+    }
+
+    int value  = table->ranks[rank_hash_index(ranks, size)];
+    int jokers = __builtin_popcountll(suits & joker_bits);
+    for (int suit = 0; suit < SUITS_COUNT; ++suit) {
+        int suited = (int)(suits >> (suit * 16)) & ((1 << RANKS_COUNT) - 1);
+        if (__builtin_popcount(suited) + jokers >= 5) {
+            int flush = table->flush[jokers][suited];
+            value     = flush > value ? flush : value;
+        }
+    }
+    return value;
+}
+
+// rank_hash_lookup() of n hands, hand i starts at cards[i * stride]. The lookups
+// don't depend on each other, the loop keeps several of them in flight.
+void rank_hash_lookup_batch(const RankHashTable* table, const int* cards, int stride, int size, int* out, size_t n);
+
+// Tables and behaviour of an Evaluator.
+struct EvaluatorOptions {
+    std::string ranks_file          = RANKS_FILE_NAME;
+    std::string standard_ranks_file = STANDARD_RANKS_FILE_NAME;
+    std::string compact_ranks_file  = COMPACT_RANKS_FILE_NAME;
+    bool        generate            = true;               // generate missing tables, otherwise throw; a temporary <table>.lock beside one serializes it
+    bool        embedded            = false;              // joker and standard tables linked into the library, see has_embedded_tables()
+    bool        compact             = false;              // lookup() reads the compact table, the full one is mapped only to generate it
+    PageMode    pages               = PageMode::DEFAULT;  // TRANSPARENT_HUGE or HUGETLB to call map_huge_pages()
+    WarmUp      warm_up             = WarmUp::NONE;       // run by load()
+    Verify      verify              = Verify::NONE;       // checksums checked in the background after loading, see verified()
+    int         threads             = 0;                  // for generation and warm-up, 0 - all cores
+    bool        relayout            = false;              // generate the tables with the hot rows first, see relayout()
+    int         max_cards           = 7;                  // 5 or 6: lookups of up to that many cards read truncated tables
+    bool        flat5               = false;              // lookups of 5 cards read the flat tables, see generate_flat5()
+    bool        rank_hash           = false;              // lookups of 5 to 7 cards read the rank hash table instead of the tries
+
+    // Options of the default evaluator: tables from POKERLIB_DATA_DIR, otherwise
+    // the embedded ones, otherwise the installed ones (see BUILD_TABLES and
+    // EMBED_TABLES in CMake), otherwise the working dir;
+    // POKERLIB_COMPACT, POKERLIB_HUGE_PAGES ("hugetlb" or anything else),
+    // POKERLIB_WARM_UP (populate, willneed, mlock or touch), POKERLIB_VERIFY
+    // (sampled or full), POKERLIB_RELAYOUT, POKERLIB_MAX_CARDS, POKERLIB_FLAT5,
+    // POKERLIB_RANK_HASH and POKERLIB_THREADS.
+    static EvaluatorOptions from_env();
+};
+
+// Owner of the mapped rank tables. Construction only stores the options, the
+// tables are mapped (and generated if missing) by the first lookup or load().
+// Lookups are thread safe, unload() is not. With max_cards < 7 the lookups of up
+// to max_cards cards read the truncated tables, so a 5 card game maps a few tens
+// of MB instead of the full tables; longer hands still map the full ones. With
+// rank_hash the lookups of 5 to 7 cards of either deck read one ~300 KB table.
+class Evaluator {
+public:
+    using Options = EvaluatorOptions;
+
+    explicit Evaluator(const Options& options = Options());
+    ~Evaluator();
+
+    Evaluator(const Evaluator&) = delete;
+    Evaluator& operator=(const Evaluator&) = delete;
+
+    // Maps the joker table lookup() reads (the compact one if asked for), then applies pages and warm_up.
+    void load();
+    // Maps the standard table standard_lookup() reads.
+    void load_standard();
+    void unload();
+
+    // Full tables, for HandCursor and anything walking more than max_cards cards.
+    const int* table() {
+        const int* ranks = ranks_.load(std::memory_order_acquire);
+        if (!ranks) {
+            load_full(false);
+            ranks = ranks_.load(std::memory_order_acquire);
+        }
+        return ranks;
+    }
+
+    const int* standard_table() {
+        const int* ranks = standard_ranks_.load(std::memory_order_acquire);
+        if (!ranks) {
+            load_full(true);
+            ranks = standard_ranks_.load(std::memory_order_acquire);
+        }
+        return ranks;
+    }
+
+    // Flat 5 card tables, for flat5_lookup().
+    const uint16_t* flat5_table() {
+        const uint16_t* ranks = flat5_ranks_.load(std::memory_order_acquire);
+        if (!ranks) {
+            load_flat5(false);
+            ranks = flat5_ranks_.load(std::memory_order_acquire);
+        }
+        return ranks;
+    }
+
+    const uint16_t* flat5_standard_table() {
+        const uint16_t* ranks = flat5_standard_ranks_.load(std::memory_order_acquire);
+        if (!ranks) {
+            load_flat5(true);
+            ranks = flat5_standard_ranks_.load(std::memory_order_acquire);
+        }
+        return ranks;
+    }
+
+    // Rank hash table, for rank_hash_lookup().
+    const RankHashTable* rank_hash_table() {
+        const RankHashTable* table = rank_hash_.load(std::memory_order_acquire);
+        if (!table) {
+            load_rank_hash();
+            table = rank_hash_.load(std::memory_order_acquire);
+        }
+        return table;
+    }
+
+    // Tables cut after max_cards cards, for table_lookup() with max_cards.
+    const int* truncated_table() {
+        const int* ranks = truncated_ranks_.load(std::memory_order_acquire);
+        if (!ranks) {
+            load_truncated(false);
+            ranks = truncated_ranks_.load(std::memory_order_acquire);
+        }
+        return ranks;
+    }
+
+    const int* truncated_standard_table() {
+        const int* ranks = truncated_standard_ranks_.load(std::memory_order_acquire);
+        if (!ranks) {
+            load_truncated(true);
+            ranks = truncated_standard_ranks_.load(std::memory_order_acquire);
+        }
+        return ranks;
+    }
+
+    size_t table_size()    { table(); return ranks_image_.size - sizeof(TableHeader); }
+    // Compact joker table, for compact_lookup().
+    const void* compact_table() {
+        const void* compact = compact_.load(std::memory_order_acquire);
+        if (!compact) {
+            load_compact();
+            compact = compact_.load(std::memory_order_acquire);
+        }
+        return compact;
+    }
+
+    int lookup(const int* cards, int size) {
+        if (size == 5 && options_.flat5) {
+            return flat5_lookup(flat5_table(), cards);
+        }
+        if (options_.rank_hash && size >= 5) {
+            return rank_hash_lookup(rank_hash_table(), cards, size);
+        }
+        if (options_.max_cards < 7 && size <= options_.max_cards) {
+            return table_lookup(truncated_table(), JOKER_DECK_SIZE, cards, size, options_.max_cards);
+        }
+        if (options_.compact) {
+            return compact_lookup(compact_table(), cards, size);
+        }
+        return table_lookup(table(), JOKER_DECK_SIZE, cards, size);
+    }
+
+    int standard_lookup(const int* cards, int size) {
+        if (size == 5 && options_.flat5) {
+            return flat5_lookup(flat5_standard_table(), cards);
+        }
+        if (options_.rank_hash && size >= 5) {
+            return rank_hash_lookup(rank_hash_table(), cards, size);
+        }
+        if (options_.max_cards < 7 && size <= options_.max_cards) {
+            return table_lookup(truncated_standard_table(), STANDARD_DECK_SIZE, cards, size, options_.max_cards);
+        }
+        return table_lookup(standard_table(), STANDARD_DECK_SIZE, cards, size);
+    }
+
+    void lookup_batch(const int* cards, int stride, int size, int* out, size_t n);
+    void standard_lookup_batch(const int* cards, int stride, int size, int* out, size_t n);
+
+    // Backs the loaded tables with 2 MiB pages to save TLB misses of the random walks:
+    // copies them to MAP_HUGETLB memory if hugetlb is set and huge pages are reserved,
+    // otherwise to transparent huge pages. Falls back to the mapped files if neither works.
+    // Loads the tables lookup() reads first, returns the pages of the main one.
+    PageMode map_huge_pages(bool hugetlb = false);
+    // Pages backing the main table of lookup() now: compact, truncated, etc. by the options.
+    PageMode page_mode() const { return lookup_image().huge.mode; }
+
+    // Faults in the loaded tables so the first lookups don't take page faults.
+    WarmUpStats        warm_up(WarmUp mode, int threads = 0);
+    // Stats of the last warm_up().
+    const WarmUpStats& warm_up_stats() const { return warm_up_stats_; }
+
+    // Waits for the checksum checks started by loading, false if a table is corrupted.
+    // Call it before serving if verify is set: lookups don't wait for it.
+    bool verified();
+
+    const Options& options() const { return options_; }
+
+private:
+    // Anonymous copy of a mapped table backed by huge pages.
+    struct HugePages {
+        void*    data = nullptr;
+        size_t   size = 0;
+        PageMode mode = PageMode::DEFAULT;
+    };
+
+    // Table file contents: mapped, or linked into the library.
+    // Lookups read the huge pages copy instead if there is one.
+    struct TableImage {
+        mio::mmap_source map;
+        const char*      data = nullptr;
+        size_t           size = 0;
+        HugePages        huge;
+    };
+
+    void load_full(bool standard);
+    void load_truncated(bool standard);
+    void load_flat5(bool standard);
+    void load_rank_hash();
+    void load_compact();
+    void load_lookup_locked();
+    void load_locked();
+    void load_truncated_locked(bool standard);
+    void load_flat5_locked(bool standard);
+    void load_rank_hash_locked();
+    void load_compact_locked();
+    template <typename Use>
+    void use_full_table(bool standard, Use use);
+    void verify_locked(const TableImage& image);
+    template <typename Generate>
+    void load_image(TableImage& image, const std::string& file_name, const char* embedded, TableFormat format, int deck_size, Generate make);
+    void load_standard_locked();
+    void prepare_locked();
+    const TableImage& lookup_image() const;
+    PageMode map_huge_pages_locked(bool hugetlb);
+    WarmUpStats warm_up_locked(WarmUp mode, int threads);
+    std::vector<std::pair<const char*, size_t>> regions() const;
+    static PageMode copy_to_huge_pages(TableImage& image, bool hugetlb);
+
+    Options                 options_;
+    std::mutex              mutex_;
+    std::atomic<const int*> ranks_{nullptr};
+    std::atomic<const int*> standard_ranks_{nullptr};
+    std::atomic<const int*> truncated_ranks_{nullptr};
+    std::atomic<const int*> truncated_standard_ranks_{nullptr};
+    std::atomic<const uint16_t*> flat5_ranks_{nullptr};
+    std::atomic<const uint16_t*> flat5_standard_ranks_{nullptr};
+    std::atomic<const RankHashTable*> rank_hash_{nullptr};
+    std::atomic<const void*> compact_{nullptr};
+    TableImage              ranks_image_;
+    TableImage              standard_ranks_image_;
+    TableImage              compact_ranks_image_;
+    TableImage              truncated_ranks_image_;
+    TableImage              truncated_standard_ranks_image_;
+    TableImage              flat5_ranks_image_;
+    TableImage              flat5_standard_ranks_image_;
+    TableImage              rank_hash_image_;
+    WarmUpStats             warm_up_stats_;
+    std::vector<std::shared_future<bool>> verifications_;
+};
+
+// True if the library was built with EMBED_TABLES: the joker and standard tables
+// are in its read-only data, shared between processes through the page cache.
+bool has_embedded_tables();
+
+// Evaluator behind the free lookup functions, with Options::from_env().
+Evaluator& default_evaluator();
+
+inline int standard_lookup(const int* cards, int size) {
+    return default_evaluator().standard_lookup(cards, size);
+}
+
+inline int lookup(const int* cards, int size) {
+    return default_evaluator().lookup(cards, size);
+}
+
+PageMode           map_huge_pages(bool hugetlb = false);
+PageMode           page_mode();
+WarmUpStats        warm_up(WarmUp mode, int threads = 0);
+const WarmUpStats& warm_up_stats();
+
+// Batched lookups of n hands with size cards each, hand i starts at cards[i * stride].
+// Hands are walked together to overlap their memory loads, results go to out[i].
+void        standard_lookup_batch(const int* cards, int stride, int size, int* out, size_t n);
+void        lookup_batch(const int* cards, int stride, int size, int* out, size_t n);
+// Name of the batch kernel picked for this CPU: "avx512", "avx2" or "scalar".
+const char* lookup_batch_kernel();
 inline Hand to_hand(int result) { return static_cast<Hand>(result >> 12); }
 
+// Incremental walk of a rank table, one card at a time. Hands sharing a prefix
+// (the board, for example) reuse its nodes instead of walking them again:
+// push the common cards once, then copy the cursor to fork it for every player.
+//
+//   HandCursor board;
+//   for (int card : board_cards) board.push(card);
+//   for (player) {
+//       HandCursor hand = board;
+//       hand.push(player.c0); hand.push(player.c1);
+//       int rank = hand.rank();
+//   }
+class HandCursor {
+public:
+    explicit HandCursor(const int* ranks = get_table(), int deck_size = JOKER_DECK_SIZE)
+        : ranks_(ranks)
+    {
+        nodes_[0] = deck_size + 1;
+    }
+
+    void push(int card) {
+        assert(size_ < 7);
+        nodes_[size_ + 1] = ranks_[nodes_[size_] + card];
+        size_++;
+    }
+
+    void pop() {
+        assert(size_ > 0);
+        size_--;
+    }
+
+    int size() const { return size_; }
+
+    // Table node after the cards pushed so far, 0 if a card was duplicated.
+    int node() const { return nodes_[size_]; }
+
+    // Rank of the first size cards (5, 6 or 7) pushed, the same as lookup() of them.
+    int rank(int size) const {
+        assert(size >= 5 && size <= size_);
+        return size == 7 ? nodes_[7] : ranks_[nodes_[size]];
+    }
+
+    int rank() const { return rank(size_); }
+
+private:
+    const int* ranks_;
+    int        size_ = 0;
+    int        nodes_[8];
+};
+
+using HoleCards = std::array<int, 2>;
+
+// Possible hole cards of a player: one hand if they are known,
+// several for a range, or none if they are unknown (any two cards).
+using Range = std::vector<HoleCards>;
+
+struct Equity {
+    double win    = 0; // share of boards won outright
+    double tie    = 0; // share of boards split with somebody
+    double equity = 0; // share of the pot, ties are split between the winners
+};
+
+struct EquityOptions {
+    size_t   trials    = 1000000;            // number of random deals
+    int      deck_size = STANDARD_DECK_SIZE; // JOKER_DECK_SIZE to deal jokers too
+    int      threads   = 0;                  // 0 - use all cores
+    uint64_t seed      = 0;                  // the same seed gives the same result on any number of threads
+};
+
+// Hold'em equity of every player by Monte Carlo: the rest of the board and unknown or
+// range hole cards are dealt at random, cards on the board and dead cards are excluded.
+std::vector<Equity> monte_carlo_equity(const std::vector<Range>& players,
+                                       const std::vector<int>& board,
+                                       const std::vector<int>& dead = {},
+                                       const EquityOptions& options = EquityOptions());
+
+// Exact Hold'em equity of known hands: every remaining board is enumerated.
+// Boards which differ only by a permutation of suits that keeps every hand, the board
+// and the dead cards the same are evaluated once and counted with their multiplicity.
+// Uses options.deck_size and options.threads.
+std::vector<Equity> exact_equity(const std::vector<HoleCards>& players,
+                                 const std::vector<int>& board,
+                                 const std::vector<int>& dead = {},
+                                 const EquityOptions& options = EquityOptions());
+
 int64_t     make_id(int64_t IDin, int newcard, int& numcards, bool with_joker=false, const Debug& debug = nodebug);
 int         save_id(int64_t ID, std::vector<int64_t>& IDs, int64_t& maxID, int& numIDs);
 int         do_eval(int64_t IDin, int numcards, const Debug& debug = nodebug);
 int         do_joker_eval(int64_t IDin, int numcards, const Debug& debug = nodebug);
 
+// Standard table and the best hand rank reachable from each of its nodes, one
+// vector per final hand size (5, 6 and 7 cards) indexed by the node ID number.
+// With it do_joker_eval() walks the real cards instead of trying every substitution
+// of the jokers. Only valid for the table it was built from.
+struct JokerEvalTable {
+    JokerEvalTable(const int* ranks, size_t size);
+
+    const int*       ranks;
+    std::vector<int> best[3];
+};
+
+int         do_joker_eval(int64_t IDin, int numcards, const JokerEvalTable& table, const Debug& debug = nodebug);
+
 inline int eval_hand(const std::vector<int>& hand) {
     switch(hand.size()) {
         case 5:
@@ -518,7 +1182,7 @@ static inline void bose_nelson_sort_7(int* wk) {
 
 // permutations 5 out of 6
 // for x in itertools.combinations(range(0, 6), 5): print x
-int perm6[6][5] = {
+const int perm6[6][5] = {
   {0, 1, 2, 3, 4},
   {0, 1, 2, 3, 5},
   {0, 1, 2, 4, 5},
@@ -529,7 +1193,7 @@ int perm6[6][5] = {
 
 // permutations 5 out of 7
 // for x in itertools.combinations(range(0, 7), 5): print x
-int perm7[21][5] = {
+const int perm7[21][5] = {
   { 0, 1, 2, 3, 4 },
   { 0, 1, 2, 3, 5 },
   { 0, 1, 2, 3, 6 },
@@ -0,0 +1,41 @@
+#include <string>
+#include <fstream>
+
+#include "pokerlib.hpp"
+
+using namespace std;
+using namespace pokerlib;
+
+// Rewrites a full table with the hot rows of every level first, see pokerlib::relayout().
+// The profile has a hand per line, e.g. "AsKsXxTd2c", otherwise deals are uniform.
+//   relayout <in> <out> [--profile hands.txt]
+int main(int argc, char** argv) try {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <in> <out> [--profile hands.txt]\n", argv[0]);
+        return 1;
+    }
+
+    vector<vector<int>> profile;
+    for (int i = 3; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--profile" && i + 1 < argc) {
+            ifstream in(argv[++i]);
+            if (!in) {
+                throw Error(string("Read file failed: ") + argv[i]);
+            }
+            string line;
+            while (getline(in, line)) {
+                if (!line.empty()) {
+                    profile.push_back(str_to_cards(line));
+                }
+            }
+        }
+    }
+
+    relayout(argv[1], argv[2], profile);
+    return 0;
+}
+catch (Error& e) {
+    fprintf(stderr, "Relayout failed: %s\n", e.what());
+    return 1;
+}
@@ -4,15 +4,17 @@
 #include <iostream>
 #include <iomanip>
 #include <bitset>
+#include <random>
+#include <numeric>
+#include <algorithm>
+#include <thread>
+#include <memory>
+#include <unistd.h>
 
 #include "gtest/gtest.h"
 
 #include <pokerlib.hpp>
 
-namespace pokerlib {
-    extern mio::mmap_source ranks_map;
-}
-
 using namespace std;
 using namespace pokerlib;
 
@@ -560,7 +562,7 @@ TEST(TestEnumerate52, Basic)
     // Total number of hands enumerated
     int count = 0;
 
-    _PDEBUG("Enumerating and evaluating all 133,784,560 possible 7-card poker hands...");
+    _PDEBUG("Enumerating and evaluating all %s possible 7-card poker hands...", "133,784,560");
 
     chrono::time_point<chrono::system_clock> start = chrono::system_clock::now();
 
@@ -620,3 +622,755 @@ TEST(TestEnumerate52, Basic)
     ASSERT_EQ(count, 133784560);
 }
 
+
+// Random hands without duplicated cards, size cards each
+std::vector<int> random_hands(int deck_size, int size, size_t count) {
+    std::mt19937 rng(42);
+    std::vector<int> deck(deck_size);
+    std::iota(deck.begin(), deck.end(), 1);
+
+    std::vector<int> hands;
+    hands.reserve(count * size);
+    for (size_t i = 0; i < count; i++) {
+        for (int j = 0; j < size; j++) {
+            std::swap(deck[j], deck[j + rng() % (deck_size - j)]);
+            hands.push_back(deck[j]);
+        }
+    }
+    return hands;
+}
+
+TEST(TestLookupBatch, Basic)
+{
+    for (int size = 5; size < 8; size++) {
+        const size_t count = 100003;
+        std::vector<int> hands = random_hands(JOKER_DECK_SIZE, size, count);
+        std::vector<int> results(count);
+
+        lookup_batch(&hands[0], size, size, &results[0], count);
+
+        for (size_t i = 0; i < count; i++) {
+            ASSERT_EQ(results[i], lookup(&hands[i * size], size));
+        }
+    }
+}
+
+TEST(TestLookupBatch52, Speed)
+{
+    const size_t count = 4000000;
+    std::vector<int> hands = random_hands(STANDARD_DECK_SIZE, 7, count);
+    std::vector<int> results(count);
+
+    chrono::time_point<chrono::system_clock> start = chrono::system_clock::now();
+    int checksum = 0;
+    for (size_t i = 0; i < count; i++) {
+        checksum += lookup(&hands[i * 7], 7);
+    }
+    chrono::time_point<chrono::system_clock> stop = chrono::system_clock::now();
+    _PDEBUG("Scalar speed: %s", with_suffix(count / chrono::duration<double>(stop - start).count()).c_str());
+
+    start = chrono::system_clock::now();
+    lookup_batch(&hands[0], 7, 7, &results[0], count);
+    stop = chrono::system_clock::now();
+    _PDEBUG("Batch speed:  %s (%s)", with_suffix(count / chrono::duration<double>(stop - start).count()).c_str(), lookup_batch_kernel());
+
+    ASSERT_EQ(std::accumulate(results.begin(), results.end(), 0), checksum);
+}
+
+TEST(TestHandCursor, Basic)
+{
+    const size_t count = 100000;
+    std::vector<int> hands = random_hands(JOKER_DECK_SIZE, 7, count);
+
+    for (size_t i = 0; i < count; i++) {
+        const int* hand = &hands[i * 7];
+
+        HandCursor cursor;
+        for (int j = 0; j < 7; j++) {
+            cursor.push(hand[j]);
+        }
+        ASSERT_EQ(cursor.rank(5), lookup(hand, 5));
+        ASSERT_EQ(cursor.rank(6), lookup(hand, 6));
+        ASSERT_EQ(cursor.rank(), lookup(hand, 7));
+
+        // fork after the board and replace the last two cards
+        cursor.pop();
+        cursor.pop();
+        HandCursor fork = cursor;
+        fork.push(hand[6]);
+        fork.push(hand[5]);
+        ASSERT_EQ(fork.size(), 7);
+        ASSERT_EQ(fork.rank(), lookup(hand, 7));
+        ASSERT_EQ(cursor.size(), 5);
+        ASSERT_EQ(cursor.rank(), lookup(hand, 5));
+    }
+}
+
+TEST(TestMonteCarloEquity, Basic)
+{
+    // AA vs KK preflop is about 82% to 18%
+    std::vector<Range> players = {{{"Ah"_c, "As"_c}}, {{"Kd"_c, "Kc"_c}}};
+    EquityOptions options;
+    options.trials = 200000;
+
+    chrono::time_point<chrono::system_clock> start = chrono::system_clock::now();
+    std::vector<Equity> result = monte_carlo_equity(players, {}, {}, options);
+    chrono::time_point<chrono::system_clock> stop = chrono::system_clock::now();
+    _PDEBUG("Speed: %s", with_suffix(options.trials / chrono::duration<double>(stop - start).count()).c_str());
+
+    ASSERT_NEAR(result[0].equity, 0.82, 0.01);
+    ASSERT_NEAR(result[0].equity + result[1].equity, 1.0, 1e-9);
+    ASSERT_NEAR(result[0].win + result[0].tie + result[1].win, 1.0, 1e-9);
+
+    // the same seed gives the same result on any number of threads
+    options.threads = 1;
+    std::vector<Equity> single = monte_carlo_equity(players, {}, {}, options);
+    ASSERT_EQ(single[0].equity, result[0].equity);
+
+    // a complete board leaves nothing to deal
+    result = monte_carlo_equity(players, str_to_cards("2c7d9hJs3s"), {}, options);
+    ASSERT_EQ(result[0].win, 1.0);
+    result = monte_carlo_equity(players, str_to_cards("KsQsJs2h3h"), {}, options);
+    ASSERT_EQ(result[0].tie, 0.0);
+    ASSERT_EQ(result[1].win, 1.0);
+
+    // a random hand against AA, and a range of pairs against AK
+    result = monte_carlo_equity({{{"Ah"_c, "As"_c}}, {}}, {}, str_to_cards("Kd"), options);
+    ASSERT_NEAR(result[0].equity, 0.85, 0.01);
+    Range pairs;
+    for (char rank : std::string("23456789TJQKA")) {
+        pairs.push_back({to_card(rank, 's'), to_card(rank, 'h')});
+    }
+    result = monte_carlo_equity({pairs, {{"Ac"_c, "Kc"_c}}}, {}, {}, options);
+    ASSERT_NEAR(result[0].equity + result[1].equity, 1.0, 1e-9);
+
+    ASSERT_THROW(monte_carlo_equity(players, str_to_cards("Ah"), {}, options), Error);
+}
+
+TEST(TestMonteCarloEquity, OverlappingRanges)
+{
+    // AsAh can't meet AsAd, the three other pairs of hands are equally likely
+    Range first  = {{"As"_c, "Ah"_c}, {"Ks"_c, "Kh"_c}};
+    Range second = {{"As"_c, "Ad"_c}, {"Qs"_c, "Qh"_c}};
+    EquityOptions options;
+    options.trials = 200000;
+
+    std::vector<Equity> result = monte_carlo_equity({first, second}, {}, {}, options);
+    double expected = 0.0;
+    for (const std::vector<HoleCards>& hands : std::vector<std::vector<HoleCards>>{
+             {first[0], second[1]}, {first[1], second[0]}, {first[1], second[1]}}) {
+        expected += exact_equity(hands, {}, {}, options)[0].equity / 3;
+    }
+    ASSERT_NEAR(result[0].equity, expected, 0.01);
+    ASSERT_NEAR(result[0].equity + result[1].equity, 1.0, 1e-9);
+
+    // a third range which overlaps both, and three players who can't all hold two aces
+    Range third = {{"As"_c, "Ad"_c}, {"Ks"_c, "Kh"_c}};
+    result = monte_carlo_equity({first, second, third}, {}, {}, options);
+    ASSERT_NEAR(result[0].equity + result[1].equity + result[2].equity, 1.0, 1e-9);
+    ASSERT_THROW(monte_carlo_equity({{{"As"_c, "Ah"_c}, {"Ad"_c, "Ac"_c}}, {{"As"_c, "Ac"_c}, {"Ah"_c, "Ad"_c}}, {{"As"_c, "Ad"_c}, {"Ac"_c, "Ah"_c}}}, {}, {}, options), Error);
+}
+
+// Equity of known hands by evaluating every board with lookup()
+std::vector<double> brute_force_equity(const std::vector<HoleCards>& players, const std::vector<int>& board) {
+    std::vector<int> deck;
+    for (int card = 1; card < STANDARD_DECK_SIZE + 1; card++) {
+        bool used = std::find(board.begin(), board.end(), card) != board.end();
+        for (const HoleCards& hand : players) {
+            used = used || hand[0] == card || hand[1] == card;
+        }
+        if (!used) {
+            deck.push_back(card);
+        }
+    }
+
+    std::vector<double> equity(players.size());
+    std::vector<int>    ranks(players.size());
+    std::vector<int>    full(board);
+    full.resize(5);
+    long boards = 0;
+
+    std::function<void(int, int)> deal = [&](int level, int first) {
+        if (level == 5) {
+            int best = 0, winners = 0;
+            for (size_t player = 0; player < players.size(); player++) {
+                int hand[7] = {players[player][0], players[player][1], full[0], full[1], full[2], full[3], full[4]};
+                ranks[player] = lookup(hand, 7);
+                best = std::max(best, ranks[player]);
+            }
+            winners = std::count(ranks.begin(), ranks.end(), best);
+            for (size_t player = 0; player < players.size(); player++) {
+                if (ranks[player] == best) {
+                    equity[player] += 1.0 / winners;
+                }
+            }
+            boards++;
+            return;
+        }
+        for (size_t i = first; i < deck.size(); i++) {
+            full[level] = deck[i];
+            deal(level + 1, i + 1);
+        }
+    };
+    deal(board.size(), 0);
+
+    for (double& e : equity) {
+        e /= boards;
+    }
+    return equity;
+}
+
+TEST(TestExactEquity, Basic)
+{
+    std::vector<HoleCards> players = {{"Ah"_c, "As"_c}, {"Kd"_c, "Kc"_c}};
+
+    chrono::time_point<chrono::system_clock> start = chrono::system_clock::now();
+    std::vector<Equity> result = exact_equity(players, {});
+    chrono::time_point<chrono::system_clock> stop = chrono::system_clock::now();
+    _PDEBUG("Preflop heads-up in: %fs", chrono::duration<double>(stop - start).count());
+
+    std::vector<double> expected = brute_force_equity(players, {});
+    ASSERT_NEAR(result[0].equity, expected[0], 1e-9);
+    ASSERT_NEAR(result[1].equity, expected[1], 1e-9);
+    ASSERT_NEAR(result[0].win + result[0].tie + result[1].win, 1.0, 1e-9);
+
+    std::vector<std::vector<HoleCards>> games = {
+        {{"Ah"_c, "Kh"_c}, {"7s"_c, "7c"_c}},
+        {{"Ah"_c, "Kh"_c}, {"Qs"_c, "Qc"_c}, {"Jd"_c, "Td"_c}},
+        {{"2h"_c, "3h"_c}, {"2s"_c, "3s"_c}},
+    };
+    std::vector<std::vector<int>> boards = {str_to_cards("8h9s"), str_to_cards("2c7d9h"), str_to_cards("4c5d")};
+    for (size_t game = 0; game < games.size(); game++) {
+        result   = exact_equity(games[game], boards[game]);
+        expected = brute_force_equity(games[game], boards[game]);
+        for (size_t player = 0; player < games[game].size(); player++) {
+            ASSERT_NEAR(result[player].equity, expected[player], 1e-9);
+        }
+    }
+
+    // a complete board
+    result = exact_equity(players, str_to_cards("KsQsJs2h3h"));
+    ASSERT_EQ(result[1].win, 1.0);
+}
+
+TEST(TestCompactTable, Basic)
+{
+    const std::string file_name = "test_handranks16.dat";
+    generate_compact(file_name, get_table(), default_evaluator().table_size());
+
+    mio::mmap_source table(file_name);
+    _PDEBUG("Compact table: %zu bytes, full table: %zu bytes", table.size(), default_evaluator().table_size());
+
+    for (int size = 5; size < 8; size++) {
+        const size_t count = 1000000;
+        std::vector<int> hands = random_hands(JOKER_DECK_SIZE, size, count);
+
+        chrono::time_point<chrono::system_clock> start = chrono::system_clock::now();
+        int checksum = 0;
+        for (size_t i = 0; i < count; i++) {
+            checksum += compact_lookup(table.data() + sizeof(TableHeader), &hands[i * size], size);
+        }
+        chrono::time_point<chrono::system_clock> stop = chrono::system_clock::now();
+        _PDEBUG("Compact speed (%d cards): %s", size, with_suffix(count / chrono::duration<double>(stop - start).count()).c_str());
+
+        start = chrono::system_clock::now();
+        for (size_t i = 0; i < count; i++) {
+            checksum -= lookup(&hands[i * size], size);
+        }
+        stop = chrono::system_clock::now();
+        _PDEBUG("Full speed (%d cards):    %s", size, with_suffix(count / chrono::duration<double>(stop - start).count()).c_str());
+        ASSERT_EQ(checksum, 0);
+
+        for (size_t i = 0; i < count; i++) {
+            ASSERT_EQ(compact_lookup(table.data() + sizeof(TableHeader), &hands[i * size], size), lookup(&hands[i * size], size));
+        }
+    }
+
+    // shorter hands stop at interior nodes, which mean nothing outside this table
+    std::vector<int> hand = str_to_cards("AsKsQsJs");
+    int out;
+    ASSERT_THROW(compact_lookup(table.data() + sizeof(TableHeader), hand.data(), 4), Error);
+    ASSERT_THROW(compact_lookup_batch(table.data() + sizeof(TableHeader), hand.data(), 4, 4, &out, 1), Error);
+
+    table.unmap();
+    std::remove(file_name.c_str());
+}
+
+TEST(TestHugePages, Basic)
+{
+    const size_t count = 4000000;
+    std::vector<int> hands = random_hands(JOKER_DECK_SIZE, 7, count);
+    std::vector<int> before(count);
+    std::vector<int> after(count);
+
+    chrono::time_point<chrono::system_clock> start = chrono::system_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        before[i] = lookup(&hands[i * 7], 7);
+    }
+    chrono::time_point<chrono::system_clock> stop = chrono::system_clock::now();
+    _PDEBUG("%s pages speed: %s", to_string(page_mode()), with_suffix(count / chrono::duration<double>(stop - start).count()).c_str());
+
+    PageMode mode = map_huge_pages();
+    ASSERT_EQ(page_mode(), mode);
+
+    start = chrono::system_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        after[i] = lookup(&hands[i * 7], 7);
+    }
+    stop = chrono::system_clock::now();
+    _PDEBUG("%s pages speed: %s", to_string(mode), with_suffix(count / chrono::duration<double>(stop - start).count()).c_str());
+
+    ASSERT_EQ(before, after);
+}
+
+TEST(TestHugePages, Compact)
+{
+    EvaluatorOptions options;
+    options.compact            = true;
+    options.compact_ranks_file = "test_pages_handranks16.dat";
+    options.pages              = PageMode::TRANSPARENT_HUGE;
+
+    // the compact table is copied when it's loaded, the full one is never mapped
+    Evaluator evaluator(options);
+    evaluator.load();
+    ASSERT_EQ(evaluator.map_huge_pages(), evaluator.page_mode());
+
+    mio::mmap_source table(options.compact_ranks_file);
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t size      = evaluator.page_mode() == PageMode::DEFAULT ? table.size() : (table.size() + (2 << 20) - 1) / (2 << 20) * (2 << 20);
+    ASSERT_EQ(evaluator.warm_up(WarmUp::TOUCH).pages, (size + page_size - 1) / page_size);
+
+    std::vector<int> hands = random_hands(JOKER_DECK_SIZE, 7, 100000);
+    for (size_t i = 0; i < hands.size() / 7; i++) {
+        ASSERT_EQ(evaluator.lookup(&hands[i * 7], 7), lookup(&hands[i * 7], 7));
+    }
+
+    table.unmap();
+    evaluator.unload();
+    remove(options.compact_ranks_file.c_str());
+}
+
+TEST(TestWarmUp, Basic)
+{
+    for (WarmUp mode : {WarmUp::WILLNEED, WarmUp::POPULATE, WarmUp::TOUCH, WarmUp::MLOCK}) {
+        WarmUpStats stats = warm_up(mode);
+        _PDEBUG("%s -> %s: %.3f seconds, %zu of %zu pages resident", to_string(mode), to_string(stats.mode), stats.seconds, stats.resident, stats.pages);
+
+        ASSERT_GT(stats.pages, 0u);
+        ASSERT_LE(stats.resident, stats.pages);
+        ASSERT_EQ(warm_up_stats().seconds, stats.seconds);
+        if (stats.mode != WarmUp::WILLNEED) {
+            ASSERT_EQ(stats.resident, stats.pages);
+        }
+    }
+}
+
+TEST(TestEvaluator, Basic)
+{
+    EvaluatorOptions options;
+    options.ranks_file = "missing_handranks.dat";
+    options.generate   = false;
+
+    Evaluator missing(options); // nothing is mapped yet
+    ASSERT_THROW(missing.table(), Error);
+
+    Evaluator evaluator;
+    std::vector<int> hands = random_hands(JOKER_DECK_SIZE, 7, 100000);
+    for (size_t i = 0; i < hands.size() / 7; i++) {
+        ASSERT_EQ(evaluator.lookup(&hands[i * 7], 7), lookup(&hands[i * 7], 7));
+    }
+
+    std::vector<int> standard_hands = random_hands(STANDARD_DECK_SIZE, 7, 100000);
+    for (size_t i = 0; i < standard_hands.size() / 7; i++) {
+        ASSERT_EQ(evaluator.standard_lookup(&standard_hands[i * 7], 7), evaluator.lookup(&standard_hands[i * 7], 7));
+    }
+
+    evaluator.unload();
+    ASSERT_EQ(evaluator.lookup(&hands[0], 7), lookup(&hands[0], 7)); // mapped again
+}
+
+TEST(TestEvaluator, GenerationLock)
+{
+    EvaluatorOptions options;
+    options.compact            = true;
+    options.compact_ranks_file = "test_lock_handranks16.dat";
+
+    // every evaluator finds the file missing, one generates it and the others map its result
+    const int count = 4;
+    std::vector<std::unique_ptr<Evaluator>> evaluators;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < count; i++) {
+        evaluators.emplace_back(new Evaluator(options));
+    }
+    for (int i = 0; i < count; i++) {
+        threads.emplace_back([&evaluators, i] { evaluators[i]->load(); });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    mio::mmap_source table(options.compact_ranks_file);
+    for (auto& evaluator : evaluators) {
+        ASSERT_EQ(memcmp(evaluator->compact_table(), table.data() + sizeof(TableHeader), table.size() - sizeof(TableHeader)), 0);
+    }
+
+    // only the compact table is mapped, the full one was needed just to generate it
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    ASSERT_EQ(evaluators[0]->warm_up(WarmUp::TOUCH).pages, (table.size() + page_size - 1) / page_size);
+
+    for (int size = 5; size < 8; size++) {
+        std::vector<int> hands = random_hands(JOKER_DECK_SIZE, size, 10000);
+        size_t           count = hands.size() / size;
+        std::vector<int> out(count);
+        evaluators[0]->lookup_batch(&hands[0], size, size, &out[0], count);
+        for (size_t i = 0; i < count; i++) {
+            ASSERT_EQ(evaluators[0]->lookup(&hands[i * size], size), lookup(&hands[i * size], size));
+            ASSERT_EQ(out[i], lookup(&hands[i * size], size));
+        }
+    }
+
+    ASSERT_NE(access((options.compact_ranks_file + ".tmp." + std::to_string(getpid())).c_str(), F_OK), 0);
+    ASSERT_NE(access((options.compact_ranks_file + ".lock").c_str(), F_OK), 0);
+    table.unmap();
+    evaluators.clear();
+    remove(options.compact_ranks_file.c_str());
+}
+
+TEST(TestTableHeader, Basic)
+{
+    EvaluatorOptions options;
+    options.compact            = true;
+    options.compact_ranks_file = "test_header_handranks16.dat";
+    options.verify             = Verify::FULL;
+
+    {
+        Evaluator evaluator(options);
+        evaluator.load();
+        ASSERT_TRUE(evaluator.verified());
+    }
+
+    mio::mmap_source file(options.compact_ranks_file);
+    const TableHeader header = *reinterpret_cast<const TableHeader*>(file.data());
+    file.unmap();
+    ASSERT_EQ(header.magic, TABLE_MAGIC);
+    ASSERT_EQ(header.format, (uint32_t)TableFormat::COMPACT);
+    ASSERT_EQ(header.deck_size, (uint32_t)JOKER_DECK_SIZE);
+
+    // flip a byte in the middle of the table: the header is fine, the checksums are not
+    {
+        FILE* f = fopen(options.compact_ranks_file.c_str(), "r+b");
+        fseek(f, sizeof(TableHeader) + header.size / 2, SEEK_SET);
+        int byte = fgetc(f);
+        fseek(f, sizeof(TableHeader) + header.size / 2, SEEK_SET);
+        fputc(byte ^ 0xFF, f);
+        fclose(f);
+    }
+    options.generate = false;
+    {
+        Evaluator evaluator(options);
+        evaluator.load();
+        ASSERT_FALSE(evaluator.verified());
+    }
+
+    // a truncated table doesn't load
+    ASSERT_EQ(truncate(options.compact_ranks_file.c_str(), sizeof(TableHeader) + header.size - 4096), 0);
+    {
+        Evaluator evaluator(options);
+        ASSERT_THROW(evaluator.load(), Error);
+    }
+
+    // unless it may be generated again
+    options.generate = true;
+    {
+        Evaluator evaluator(options);
+        evaluator.load();
+        ASSERT_TRUE(evaluator.verified());
+    }
+
+    remove(options.compact_ranks_file.c_str());
+}
+
+TEST(TestTableLookup, Basic)
+{
+    const int* ranks = get_table();
+    std::vector<int> hands = random_hands(JOKER_DECK_SIZE, 7, 100000);
+    for (int size = 5; size < 8; size++) {
+        for (size_t i = 0; i < hands.size() / 7; i++) {
+            ASSERT_EQ(table_lookup(ranks, JOKER_DECK_SIZE, &hands[i * 7], size), lookup(&hands[i * 7], size));
+        }
+    }
+}
+
+TEST(TestRelayout, Basic)
+{
+    Evaluator&        evaluator = default_evaluator();
+    const std::string file_name = "test_relayout_standard_handranks.dat";
+
+    std::vector<int>              hands = random_hands(STANDARD_DECK_SIZE, 7, 100000);
+    std::vector<std::vector<int>> profile;
+    for (size_t i = 0; i < 1000; i++) {
+        profile.emplace_back(&hands[i * 7], &hands[i * 7 + 7]);
+    }
+
+    for (bool uniform : {true, false}) {
+        relayout(evaluator.options().standard_ranks_file, file_name, uniform ? std::vector<std::vector<int>>() : profile);
+
+        EvaluatorOptions options;
+        options.standard_ranks_file = file_name;
+        options.generate            = false;
+        options.verify              = Verify::FULL;
+        Evaluator relaid(options);
+        for (int size = 5; size < 8; size++) {
+            for (size_t i = 0; i < hands.size() / 7; i++) {
+                ASSERT_EQ(relaid.standard_lookup(&hands[i * 7], size), evaluator.standard_lookup(&hands[i * 7], size));
+            }
+        }
+        ASSERT_TRUE(relaid.verified());
+    }
+
+    remove(file_name.c_str());
+}
+
+TEST(TestRelayout, JokerGeneration)
+{
+    // joker tables from the standard table and from a relaid copy of it, in one
+    // process: the values the joker evaluation reads are per standard table
+    Evaluator&        evaluator     = default_evaluator();
+    const std::string standard_file = "test_relayout_standard_handranks.dat";
+    const std::string plain_file    = "test_plain_handranks.dat";
+    const std::string relaid_file   = "test_relaid_handranks.dat";
+
+    generate(plain_file, 0, evaluator.options().standard_ranks_file);
+    relayout(evaluator.options().standard_ranks_file, standard_file);
+    generate(relaid_file, 0, standard_file);
+
+    for (const std::string& file_name : {plain_file, relaid_file}) {
+        EvaluatorOptions options;
+        options.ranks_file = file_name;
+        options.generate   = false;
+        Evaluator generated(options);
+
+        std::vector<int> hands = random_hands(JOKER_DECK_SIZE, 7, 100000);
+        int errors = 0;
+        for (int size = 5; size < 8; size++) {
+            for (size_t i = 0; i < hands.size() / 7; i++) {
+                errors += generated.lookup(&hands[i * 7], size) != evaluator.lookup(&hands[i * 7], size);
+            }
+        }
+        ASSERT_EQ(errors, 0) << file_name;
+    }
+
+    for (const std::string& file_name : {standard_file, plain_file, relaid_file}) {
+        remove(file_name.c_str());
+    }
+}
+
+TEST(TestTruncatedTables, Basic)
+{
+    ASSERT_EQ(truncated_file_name("dir/handranks.dat", 5), "dir/handranks5.dat");
+    ASSERT_EQ(truncated_file_name("dir.d/handranks", 6), "dir.d/handranks6");
+
+    Evaluator& evaluator = default_evaluator();
+    for (int max_cards : {5, 6}) {
+        EvaluatorOptions options;
+        options.max_cards = max_cards;
+        options.verify    = Verify::FULL;
+
+        Evaluator truncated(options);
+        truncated.load();
+        truncated.load_standard();
+        ASSERT_TRUE(truncated.verified());
+
+        for (int deck_size : {STANDARD_DECK_SIZE, JOKER_DECK_SIZE}) {
+            std::vector<int> hands = random_hands(deck_size, 7, 100000);
+            size_t           count = hands.size() / 7;
+            std::vector<int> out(count);
+            for (int size = 5; size < 8; size++) {
+                if (deck_size == JOKER_DECK_SIZE)
+                    truncated.lookup_batch(&hands[0], 7, size, &out[0], count);
+                else
+                    truncated.standard_lookup_batch(&hands[0], 7, size, &out[0], count);
+
+                for (size_t i = 0; i < count; i++) {
+                    int expected = deck_size == JOKER_DECK_SIZE ? evaluator.lookup(&hands[i * 7], size) : evaluator.standard_lookup(&hands[i * 7], size);
+                    int result   = deck_size == JOKER_DECK_SIZE ? truncated.lookup(&hands[i * 7], size) : truncated.standard_lookup(&hands[i * 7], size);
+                    ASSERT_EQ(result, expected);
+                    ASSERT_EQ(out[i], expected);
+                }
+            }
+        }
+
+        remove(truncated_file_name(options.ranks_file, max_cards).c_str());
+        remove(truncated_file_name(options.standard_ranks_file, max_cards).c_str());
+    }
+}
+
+TEST(TestFlat5, Basic)
+{
+    ASSERT_EQ(flat5_size(STANDARD_DECK_SIZE), 2598960);
+    ASSERT_EQ(flat5_size(JOKER_DECK_SIZE), 3819816);
+    ASSERT_EQ(flat5_file_name("dir/handranks.dat"), "dir/handranks_flat5.dat");
+
+    EvaluatorOptions options;
+    options.flat5     = true;
+    options.max_cards = 5;
+    options.verify    = Verify::FULL;
+    Evaluator flat(options);
+    flat.load();
+    flat.load_standard();
+    ASSERT_TRUE(flat.verified());
+
+    Evaluator& evaluator = default_evaluator();
+    for (int deck_size : {STANDARD_DECK_SIZE, JOKER_DECK_SIZE}) {
+        const uint16_t* table = deck_size == JOKER_DECK_SIZE ? flat.flat5_table() : flat.flat5_standard_table();
+        const int*      ranks = deck_size == JOKER_DECK_SIZE ? evaluator.table() : evaluator.standard_table();
+
+        // every hand has its own index
+        int c[5];
+        int index  = 0;
+        int errors = 0;
+        for (c[4] = 1; c[4] <= deck_size; c[4]++)
+        for (c[3] = 1; c[3] < c[4]; c[3]++)
+        for (c[2] = 1; c[2] < c[3]; c[2]++)
+        for (c[1] = 1; c[1] < c[2]; c[1]++)
+        for (c[0] = 1; c[0] < c[1]; c[0]++) {
+            errors += flat5_index(c) != index++;
+            errors += flat5_lookup(table, c) != table_lookup(ranks, deck_size, c, 5);
+        }
+        ASSERT_EQ(errors, 0);
+
+        // in any order, one by one and batched
+        std::vector<int> hands = random_hands(deck_size, 5, 100003);
+        size_t           count = hands.size() / 5;
+        std::vector<int> out(count);
+        if (deck_size == JOKER_DECK_SIZE)
+            flat.lookup_batch(&hands[0], 5, 5, &out[0], count);
+        else
+            flat.standard_lookup_batch(&hands[0], 5, 5, &out[0], count);
+        for (size_t i = 0; i < count; i++) {
+            int expected = table_lookup(ranks, deck_size, &hands[i * 5], 5);
+            ASSERT_EQ(deck_size == JOKER_DECK_SIZE ? flat.lookup(&hands[i * 5], 5) : flat.standard_lookup(&hands[i * 5], 5), expected);
+            ASSERT_EQ(out[i], expected);
+        }
+
+        // hands with a repeated card rank 0, in any lane of a batch
+        hands = random_hands(deck_size, 5, 16);
+        for (size_t i = 0; i < 16; i += 3) {
+            hands[i * 5 + i % 5] = hands[i * 5 + (i + 1) % 5];
+        }
+        out.resize(16);
+        if (deck_size == JOKER_DECK_SIZE)
+            flat.lookup_batch(&hands[0], 5, 5, &out[0], 16);
+        else
+            flat.standard_lookup_batch(&hands[0], 5, 5, &out[0], 16);
+        for (size_t i = 0; i < 16; i++) {
+            int expected = i % 3 == 0 ? 0 : table_lookup(ranks, deck_size, &hands[i * 5], 5);
+            ASSERT_EQ(flat5_lookup(table, &hands[i * 5]), expected);
+            ASSERT_EQ(out[i], expected);
+        }
+        ASSERT_EQ(flat5_index(&hands[0]), -1);
+    }
+
+    for (const std::string& file_name : {options.ranks_file, options.standard_ranks_file}) {
+        remove(flat5_file_name(file_name).c_str());
+    }
+}
+
+TEST(TestRankHash, Basic)
+{
+    ASSERT_EQ(RANK_HASH_BINOMIALS.offsets[8], 8568 + 27132 + 77520);
+    ASSERT_LT(sizeof(RankHashTable), 512u << 10);
+    ASSERT_EQ(rank_hash_file_name("dir/handranks.dat"), "dir/handranks_hash.dat");
+
+    // every multiset has its own index, in any order
+    std::vector<bool> seen(RANK_HASH_BINOMIALS.offsets[8]);
+    int r[7];
+    for (int size = 5; size < 8; size++) {
+        for (r[0] = 0; r[0] < JOKER_RANKS_COUNT; r[0]++)
+        for (r[1] = r[0]; r[1] < JOKER_RANKS_COUNT; r[1]++)
+        for (r[2] = r[1]; r[2] < JOKER_RANKS_COUNT; r[2]++)
+        for (r[3] = r[2]; r[3] < JOKER_RANKS_COUNT; r[3]++)
+        for (r[4] = r[3]; r[4] < JOKER_RANKS_COUNT; r[4]++)
+        for (r[5] = size > 5 ? r[4] : 0; r[5] < (size > 5 ? JOKER_RANKS_COUNT : 1); r[5]++)
+        for (r[6] = size > 6 ? r[5] : 0; r[6] < (size > 6 ? JOKER_RANKS_COUNT : 1); r[6]++) {
+            int reversed[7];
+            std::reverse_copy(r, r + size, reversed);
+            int index = rank_hash_index(r, size);
+            ASSERT_EQ(rank_hash_index(reversed, size), index);
+            ASSERT_GE(index, RANK_HASH_BINOMIALS.offsets[size]);
+            ASSERT_LT(index, RANK_HASH_BINOMIALS.offsets[size + 1]);
+            ASSERT_FALSE(seen[index]);
+            seen[index] = true;
+        }
+    }
+
+    EvaluatorOptions options;
+    options.rank_hash = true;
+    options.verify    = Verify::FULL;
+    Evaluator hash(options);
+    hash.load();
+    hash.load_standard();
+    ASSERT_TRUE(hash.verified());
+
+    // five of a kind, flushes made with jokers and the hands of both decks
+    Evaluator& evaluator = default_evaluator();
+    for (const auto& str : {"AsAhAdAcXs2s3d", "2h7h9hXsXhKdKc", "XsXhXdXc2c", "KhQhJhThXd9d9c", "2s3s4s5sXh"}) {
+        std::vector<int> cards = str_to_cards(str);
+        ASSERT_EQ(hash.lookup(&cards[0], cards.size()), evaluator.lookup(&cards[0], cards.size())) << str;
+    }
+    for (int deck_size : {STANDARD_DECK_SIZE, JOKER_DECK_SIZE}) {
+        for (int size = 5; size < 8; size++) {
+            std::vector<int> hands = random_hands(deck_size, size, 100003);
+            size_t           count = hands.size() / size;
+            std::vector<int> out(count);
+            if (deck_size == JOKER_DECK_SIZE)
+                hash.lookup_batch(&hands[0], size, size, &out[0], count);
+            else
+                hash.standard_lookup_batch(&hands[0], size, size, &out[0], count);
+
+            int errors = 0;
+            for (size_t i = 0; i < count; i++) {
+                const int* cards    = &hands[i * size];
+                int        expected = deck_size == JOKER_DECK_SIZE ? evaluator.lookup(cards, size) : evaluator.standard_lookup(cards, size);
+                errors += (deck_size == JOKER_DECK_SIZE ? hash.lookup(cards, size) : hash.standard_lookup(cards, size)) != expected;
+                errors += out[i] != expected;
+            }
+            ASSERT_EQ(errors, 0);
+        }
+    }
+
+    remove(rank_hash_file_name(options.ranks_file).c_str());
+}
+
+TEST(TestRankHash, RepeatedCards)
+{
+    EvaluatorOptions options;
+    options.rank_hash = true;
+    Evaluator hash(options);
+
+    for (int deck_size : {STANDARD_DECK_SIZE, JOKER_DECK_SIZE}) {
+        for (int size = 5; size < 8; size++) {
+            // every third hand repeats one of its cards somewhere
+            std::vector<int> hands = random_hands(deck_size, size, 300);
+            size_t           count = hands.size() / size;
+            for (size_t i = 0; i < count; i += 3) {
+                hands[i * size + i % size] = hands[i * size + (i + 1) % size];
+            }
+            std::vector<int> out(count);
+            if (deck_size == JOKER_DECK_SIZE)
+                hash.lookup_batch(&hands[0], size, size, &out[0], count);
+            else
+                hash.standard_lookup_batch(&hands[0], size, size, &out[0], count);
+
+            for (size_t i = 0; i < count; i++) {
+                const int* cards = &hands[i * size];
+                int        rank  = rank_hash_lookup(hash.rank_hash_table(), cards, size);
+                ASSERT_EQ(rank == 0, i % 3 == 0);
+                ASSERT_EQ(out[i], rank);
+                ASSERT_EQ(deck_size == JOKER_DECK_SIZE ? hash.lookup(cards, size) : hash.standard_lookup(cards, size), rank);
+            }
+        }
+    }
+
+    remove(rank_hash_file_name(options.ranks_file).c_str());
+}